@@ -0,0 +1,426 @@
+-- Benchmarks for the lcurses bindings
+-- Usage: lua bench.lua [--json FILE] [section...]
+--
+-- Sections that need a screen run on a headless terminal (see
+-- curses.headless), so they can be run from make without a tty and
+-- give the same figures on every machine. With --json, the results
+-- are also written to FILE, for comparing one release with another.
+--
+-- To compare the chstr fill paths against the plain scalar loops,
+-- build a second copy with CPPFLAGS=-DLCURSES_NO_SIMD and run both.
+
+require "curses"
+
+local clock = os.clock
+local results, section_name = {}, nil
+
+-- Run f repeatedly for at least min_time seconds, and record the
+-- rate of calls, and of units (e.g. cells) processed per call.
+local function bench (name, units, f, min_time)
+  min_time = min_time or 0.5
+  local iters, elapsed = 1, 0
+  while true do
+    local t0 = clock ()
+    for _ = 1, iters do f () end
+    elapsed = clock () - t0
+    if elapsed >= min_time then break end
+    iters = iters * 2
+  end
+  table.insert (results, {
+    section = section_name, name = name, units = units,
+    iterations = iters, seconds = elapsed,
+    ops_per_sec = iters / elapsed, ns_per_op = elapsed * 1e9 / iters,
+  })
+end
+
+-- Record a one-off timing, such as starting the screen.
+local function once (name, f)
+  local t0 = clock ()
+  f ()
+  local elapsed = clock () - t0
+  table.insert (results, {
+    section = section_name, name = name, units = 1,
+    iterations = 1, seconds = elapsed,
+    ops_per_sec = 1 / elapsed, ns_per_op = elapsed * 1e9,
+  })
+end
+
+local function format_result (r)
+  local s = string.format ("%-32s %14.0f ops/s %12.1f ns/op",
+                           r.name, r.ops_per_sec, r.ns_per_op)
+  if r.units ~= 1 then
+    s = s .. string.format (" %10.2f ns/unit", r.ns_per_op / r.units)
+  end
+  return s
+end
+
+local function json_string (s)
+  return '"' .. s:gsub ('[%c"\\]', function (c)
+    return string.format ("\\u%04x", c:byte ())
+  end) .. '"'
+end
+
+local function write_json (path, all)
+  local out = {}
+  for i, r in ipairs (all) do
+    out[i] = string.format (
+      '    {"section": %s, "name": %s, "units": %d, "iterations": %d, ' ..
+      '"seconds": %.6f, "ops_per_sec": %.1f, "ns_per_op": %.2f}',
+      json_string (r.section), json_string (r.name), r.units,
+      r.iterations, r.seconds, r.ops_per_sec, r.ns_per_op)
+  end
+  local h = assert (io.open (path, "w"))
+  h:write ('{\n  "date": ', json_string (os.date ("!%Y-%m-%dT%H:%M:%SZ")), ',\n',
+           '  "results": [\n', table.concat (out, ",\n"), '\n  ]\n}\n')
+  h:close ()
+end
+
+-- The headless screen is started by the first section that needs it,
+-- and shared by the rest, as there can only be one per process.
+local ROWS, COLS = 50, 200
+local started = false
+local function screen ()
+  if not started then
+    once ("curses.headless (50, 200)", function () curses.headless (ROWS, COLS) end)
+    started = true
+  end
+  return curses.stdscr ()
+end
+
+local function with_screen (f)
+  return function ()
+    screen ()
+    f ()
+    curses.headless_output ()
+  end
+end
+
+local sections, order = {}, {}
+local function section (name, f)
+  sections[name] = f
+  table.insert (order, name)
+end
+
+section ("startup", function ()
+  bench ("require \"curses\"", 1, function ()
+    package.loaded.curses, package.loaded.curses_c, curses = nil, nil, nil
+    require "curses"
+  end, 0.2)
+  bench ("first constant lookup", 1, function ()
+    rawset (curses, "KEY_F12", nil)
+    return curses.KEY_F12
+  end, 0.1)
+  bench ("cached constant lookup", 1, function () return curses.A_BOLD end, 0.1)
+  screen ()
+end)
+
+section ("chstr", function ()
+  local width = 200
+  local cs = curses.new_chstr (width)
+  local line = string.rep ("status: ok | ", 16):sub (1, width)
+  local short = "-=*"
+
+  bench ("chstr:set_str 200 cols", width, function ()
+    cs:set_str (0, line, curses.A_BOLD)
+  end)
+  bench ("chstr:set_str repeat 3x67", width, function ()
+    cs:set_str (0, short, curses.A_REVERSE, 67)
+  end)
+  bench ("chstr:set_ch repeat 200", width, function ()
+    cs:set_ch (0, " ", curses.A_NORMAL, width)
+  end)
+
+  -- per-cell attributes: one set_ch per cell versus one call per line
+  local attrs = string.rep ("\1\1\1\1\2\2\3\3\3\3\3\3\3", 16):sub (1, width)
+  local palette = { 1, 2, 4 }
+  local runs = {}
+  for i = 1, width / 10 do runs[i] = { 10, palette[i % 3 + 1] } end
+  bench ("chstr:set_ch per cell", width, function ()
+    for i = 1, width do
+      cs:set_ch (i - 1, line:sub (i, i), palette[attrs:byte (i)])
+    end
+  end)
+  bench ("chstr:set_str_attrs string", width, function ()
+    cs:set_str_attrs (0, line, attrs, palette)
+  end)
+  bench ("chstr:set_str_attrs runs", width, function ()
+    cs:set_str_attrs (0, line, runs)
+  end)
+  -- a window onto a wide scrollback line
+  local wide = curses.new_chstr (4096)
+  bench ("chstr:dup 4096", 1, function () wide:dup () end)
+  bench ("chstr:view 200 of 4096", 1, function () wide:view (1000, width) end)
+  -- reading a line back
+  cs:set_str_attrs (0, line, runs)
+  bench ("chstr:get per cell", width, function ()
+    for i = 0, width - 1 do cs:get (i) end
+  end)
+  bench ("chstr:text", width, function () cs:text () end)
+  bench ("chstr:runs", width, function () cs:runs () end)
+end)
+
+-- the bindings an application spends most of its time in
+section ("render", with_screen (function ()
+  local scr = screen ()
+  local line = string.rep ("0123456789", COLS / 10)
+  local cs = curses.new_chstr (COLS)
+  cs:set_str (0, line, curses.A_BOLD)
+
+  bench ("win:addstr (waddnstr)", COLS, function ()
+    scr:move (0, 0)
+    scr:addstr (line, COLS)
+  end)
+  bench ("win:mvaddstr (mvwaddnstr)", COLS, function ()
+    scr:mvaddstr (1, 0, line, COLS)
+  end)
+  bench ("win:addchstr (waddchnstr)", COLS, function ()
+    scr:addchstr (cs)
+  end)
+  if scr.addwstr then
+    local greek = string.rep ("\206\177\206\178\206\179\206\180 ", COLS / 5)
+    bench ("win:addwstr ASCII", COLS, function ()
+      scr:move (0, 0)
+      scr:addwstr (line)
+    end)
+    bench ("win:addwstr UTF-8", COLS, function ()
+      scr:move (0, 0)
+      scr:addwstr (greek)
+    end)
+    local ws = curses.new_wchstr (COLS)
+    bench ("wchstr:set_str UTF-8", COLS, function ()
+      ws:set_str (0, greek, curses.A_BOLD)
+    end)
+    bench ("win:add_wchstr", COLS, function ()
+      scr:mvadd_wchstr (0, 0, ws)
+    end)
+  end
+  bench ("win:mvwinchnstr", COLS, function ()
+    scr:mvwinchnstr (1, 0, COLS)
+  end)
+
+  -- every cell changes on every frame, so doupdate rewrites the screen;
+  -- draining the output keeps the terminal's file from growing
+  local frames = { string.rep ("x", COLS), string.rep ("o", COLS) }
+  local frame = 1
+  bench ("full screen noutrefresh+doupdate", ROWS * COLS, function ()
+    frame = 3 - frame
+    for y = 0, ROWS - 1 do scr:mvaddstr (y, 0, frames[frame], COLS) end
+    scr:noutrefresh ()
+    curses.doupdate ()
+    curses.headless_output ()
+  end, 1)
+
+  -- ten small windows changing every frame
+  local wins = {}
+  for i = 1, 10 do wins[i] = curses.newwin (2, 10, (i - 1) * 3, 0) end
+  bench ("10 windows, refresh each", 10, function ()
+    for i = 1, 10 do
+      wins[i]:mvaddstr (0, 0, frames[frame]:sub (1, 9))
+      wins[i]:refresh ()
+    end
+    frame = 3 - frame
+    curses.headless_output ()
+  end)
+  bench ("10 windows, mark + frame", 10, function ()
+    for i = 1, 10 do
+      wins[i]:mvaddstr (0, 0, frames[frame]:sub (1, 9))
+      wins[i]:mark ()
+    end
+    curses.frame ()
+    frame = 3 - frame
+    curses.headless_output ()
+  end)
+  for i = 1, 10 do wins[i]:close () end
+  scr:touch ()
+
+  scr:timeout (100)
+  bench ("win:getch, injected input", 1, function ()
+    curses.headless_input ("a")
+    scr:getch ()
+  end)
+  -- a 1000 key paste, read one key per call and as one batch
+  local paste = string.rep ("x", 1000)
+  bench ("win:getch, 1000 key paste", 1000, function ()
+    curses.headless_input (paste)
+    for _ = 1, 1000 do scr:getch () end
+  end)
+  bench ("win:getch_batch, 1000 key paste", 1000, function ()
+    curses.headless_input (paste)
+    scr:getch_batch (1000)
+  end)
+  bench ("win:getch_batch string, 1000 key paste", 1000, function ()
+    curses.headless_input (paste)
+    scr:getch_batch (1000, true)
+  end)
+  if scr.get_wch and os.setlocale ("C.UTF-8", "ctype") then
+    local text = string.rep ("\206\177\206\178\206\179", 333) .. "x"
+    bench ("win:get_wch, 1000 char UTF-8 paste", 1000, function ()
+      curses.headless_input (text)
+      for _ = 1, 1000 do scr:get_wch () end
+    end)
+    bench ("win:get_wch_batch string, 1000 char UTF-8 paste", 1000, function ()
+      curses.headless_input (text)
+      scr:get_wch_batch (1000, true)
+    end)
+  end
+  scr:timeout (-1)
+end))
+
+section ("inchstr", with_screen (function ()
+  local scr = screen ()
+  local rows, cols = scr:getmaxyx ()
+  for y = 0, rows - 1 do
+    scr:mvaddstr (y, 0, string.rep (string.char (65 + y % 26), cols - 1))
+  end
+  local cs = curses.new_chstr (cols)
+  bench ("win:mvwinchnstr per line", rows * cols, function ()
+    for y = 0, rows - 1 do scr:mvwinchnstr (y, 0, cols) end
+  end)
+  bench ("win:mvinchstr_into per line", rows * cols, function ()
+    for y = 0, rows - 1 do scr:mvinchstr_into (cs, y, 0) end
+  end)
+  local all = scr:inchstr_all ()
+  bench ("win:inchstr_all", rows * cols, function ()
+    scr:inchstr_all (all)
+  end)
+end))
+
+section ("blit", with_screen (function ()
+  local scr = screen ()
+  local rows, cols = scr:getmaxyx ()
+  local g = curses.new_grid (rows, cols)
+  g:fill (0, 0, rows, cols, "x")
+  local lines = {}
+  for y = 0, rows - 1 do lines[y] = g:row (y):dup () end
+  bench ("win:mvaddchstr per line", rows * cols, function ()
+    for y = 0, rows - 1 do scr:mvaddchstr (y, 0, lines[y]) end
+  end)
+  bench ("win:blit", rows * cols, function ()
+    scr:blit (g, 0, 0, 0, 0)
+  end)
+end))
+
+-- one process serving several terminals: a frame drawn on each of n
+-- screens in turn, switching with set_term.  The headless screen stays
+-- live throughout, so curses keeps the memory of every screen closed
+-- here until the end (see curses.delscreen); their streams are closed
+-- at once.
+section ("screens", function ()
+  screen ()
+  local home = curses.screen ()
+  local out, inp = io.open ("/dev/null", "w"), io.open ("/dev/null")
+  for _, n in ipairs { 1, 8, 32 } do
+    local screens = {}
+    for i = 1, n do screens[i] = curses.newterm ("xterm", out, inp) end
+    local rows, cols = screens[1]:stdscr ():getmaxyx ()
+    local frames = { string.rep ("x", cols), string.rep ("o", cols) }
+    local frame = 1
+    bench ("full frame on " .. n .. " screens", n * rows * cols, function ()
+      frame = 3 - frame
+      for i = 1, n do
+        curses.set_term (screens[i])
+        local win = screens[i]:stdscr ()
+        for y = 0, rows - 1 do win:mvaddstr (y, 0, frames[frame], cols) end
+        win:refresh ()
+      end
+    end)
+    for i = 1, n do screens[i]:close () end
+  end
+  out:close ()
+  inp:close ()
+  curses.set_term (home)
+end)
+
+-- the stdscr shortcuts, against the Lua wrappers they replaced
+section ("stdscr", with_screen (function ()
+  local function lua_addstr (...)
+    if #{...} == 3 then
+      return curses.stdscr ():mvaddstr (...)
+    else
+      return curses.stdscr ():addstr (...)
+    end
+  end
+  local function lua_addch (...)
+    if #{...} == 3 then
+      return curses.stdscr ():mvaddch (...)
+    else
+      return curses.stdscr ():addch (...)
+    end
+  end
+  bench ("Lua addstr (y, x, s)", 1, function () lua_addstr (0, 0, "hello") end)
+  bench ("curses.addstr (y, x, s)", 1, function () curses.addstr (0, 0, "hello") end)
+  bench ("Lua addch (y, x, c)", 1, function () lua_addch (0, 0, "x") end)
+  bench ("curses.addch (y, x, c)", 1, function () curses.addch (0, 0, "x") end)
+  bench ("curses.move (y, x)", 1, function () curses.move (1, 1) end)
+  bench ("curses.stdscr ()", 1, function () curses.stdscr () end)
+end))
+
+-- per-call overhead of the bindings: argument checking and dispatch
+section ("dispatch", with_screen (function ()
+  local win = curses.newwin (10, 10, 0, 0)
+  local cs = curses.new_chstr (10)
+  local calls = {
+    { "getyx" }, { "getmaxyx" }, { "getbegyx" }, { "getparyx" },
+    { "getbkgd" }, { "winch" }, { "mvwinch", 0, 0 }, { "move", 0, 0 },
+    { "is_wintouched" }, { "is_linetouched", 0 }, { "attrset", 0 },
+    { "addchstr", cs },
+  }
+  for _, call in ipairs (calls) do
+    local f, a, b = win[call[1]], call[2], call[3]
+    bench ("win:" .. call[1], 1, function () f (win, a, b) end, 0.1)
+  end
+  -- finding the damaged lines of a full-height window
+  local scr = screen ()
+  for y = 0, ROWS - 1, 3 do scr:mvaddstr (y, 0, "x") end
+  bench ("win:is_linetouched per row", ROWS, function ()
+    for y = 0, ROWS - 1 do scr:is_linetouched (y) end
+  end)
+  bench ("win:touched_lines", ROWS, function () scr:touched_lines () end)
+  bench ("win:touched_lines ranges", ROWS, function () scr:touched_lines (true) end)
+  bench ("chstr:len", 1, function () cs:len () end, 0.1)
+  bench ("chstr:get", 1, function () cs:get (0) end, 0.1)
+
+  -- every window method, failing its type check on a non-window self
+  local methods, failed = {}, 0
+  for name, f in pairs (getmetatable (win)) do
+    if type (f) == "function" and not name:match ("^__") then
+      table.insert (methods, f)
+    end
+  end
+  bench ("window methods, bad self (" .. #methods .. ")", #methods, function ()
+    for i = 1, #methods do
+      if not pcall (methods[i], cs) then failed = failed + 1 end
+    end
+  end)
+  win:close ()
+end))
+
+local json, wanted = nil, {}
+local argv = {...}
+local i = 1
+while i <= #argv do
+  if argv[i] == "--json" then
+    json, i = argv[i + 1] or error ("--json needs a file name"), i + 2
+  else
+    table.insert (wanted, argv[i])
+    i = i + 1
+  end
+end
+if #wanted == 0 then wanted = order end
+
+local all = {}
+local ok, err = pcall (function ()
+  for _, name in ipairs (wanted) do
+    local f = sections[name] or error ("no such benchmark section: " .. name)
+    results, section_name = {}, name
+    f ()
+    print ("[" .. name .. "]")
+    for _, r in ipairs (results) do
+      print (format_result (r))
+      table.insert (all, r)
+    end
+  end
+end)
+if started then curses.endwin () end
+if not ok then error (err, 0) end
+if json then write_json (json, all) end
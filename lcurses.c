@@ -26,16 +26,42 @@
 
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 #include <lua.h>
 #include <lauxlib.h>
-#ifdef HAVE_NCURSES_H
+#include <lualib.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+/* ncursesw declares the wide character functions only on request */
+#ifdef HAVE_NCURSESW
+#define NCURSES_WIDECHAR 1
+#include <wchar.h>
+#endif
+#if defined(HAVE_NCURSESW_H)
+#include <ncursesw/curses.h>
+#elif defined(HAVE_NCURSES_H)
 #include <ncurses.h>
 #else
 #include <curses.h>
 #endif
 #include <term.h>
+#ifndef LCURSES_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
 
 /* strlcpy() implementation for non-BSD based Unices.
    strlcpy() is a safer less error-prone replacement for strncpy(). */
@@ -50,10 +76,57 @@
 static const char *STDSCR_REGISTRY     = "curses:stdscr";
 static const char *WINDOWMETA          = "curses:window";
 static const char *CHSTRMETA           = "curses:chstr";
+#ifdef HAVE_NCURSESW
+static const char *WCHSTRMETA          = "curses:wchstr";
+#endif
+static const char *GRIDMETA            = "curses:grid";
+static const char *SCREENMETA          = "curses:screen";
 static const char *RIPOFF_TABLE        = "curses:ripoffline";
+static const char *WINDOW_CACHE        = "curses:windows";
+static const char *ROOT_WINDOWS        = "curses:roots";
+static const char *CURRENT_SCREEN      = "curses:current screen";
+static const char *LIVE_SCREENS        = "curses:screens";
+static const char *MARKED_WINDOWS      = "curses:marked";
+static const char *PROFILE_TABLE       = "curses:profile";
+static const char *MODULE_STATE        = "curses:state";
 
 #define B(v) ((((int) (v)) == ERR))
 
+/*
+** curses keeps one set of screens per process, so calls from several
+** Lua states, each in its own thread, take turns with curses_lock: with
+** LCURSES_THREADS set in the environment every function holds it (see
+** lc_wrapped), and so holds up the other states while it runs.  Only
+** the functions that wait (lc_waiting) let it go while they wait: wait,
+** napms, and the reads of keys, getch, mvgetch, get_wch, their batch
+** variants and getstr and its variants, which take it only to read
+** keys that have come; getstr holds it from the first key to the end
+** of the line.  delay_output holds it while it waits.  While the
+** render thread runs (see curses.render_thread), it holds the lock to
+** update the terminal, and so do calls that use curses' screens or
+** write to the terminal.
+*/
+#ifdef HAVE_PTHREAD
+static pthread_once_t curses_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t curses_lock;
+static pthread_cond_t render_cond;
+static int locking = 0;
+static int lock_depth = 0;              /* lc_wrapped's holds, by the holder */
+static int render_running = 0;
+static int render_pipe[2] = { -1, -1 };
+static int render_deferred = 0;         /* a frame was dropped */
+static void lc_render_stop(void);
+static int lc_render_submit(lua_State *L);
+static void lc_render_winch(void);
+#define LC_LOCK()   do { if (locking || render_running) pthread_mutex_lock(&curses_lock); } while (0)
+#define LC_UNLOCK() do { if (locking || render_running) pthread_mutex_unlock(&curses_lock); } while (0)
+#else
+#define LC_LOCK()   ((void) 0)
+#define LC_UNLOCK() ((void) 0)
+#define lc_render_stop() ((void) 0)
+#define lc_render_winch() ((void) 0)
+#endif
+
 /* ======================================================= */
 
 #define LC_NUMBER(v)                        \
@@ -111,6 +184,17 @@ static const char *RIPOFF_TABLE        = "curses:ripoffline";
         return 1;                           \
     }
 
+#define LC_LOCKED_BOOLOK(v)                 \
+    static int lc_ ## v(lua_State *L)       \
+    {                                       \
+        int ret;                            \
+        LC_LOCK();                          \
+        ret = v();                          \
+        LC_UNLOCK();                        \
+        lua_pushboolean(L, B(ret));         \
+        return 1;                           \
+    }
+
 #define LC_BOOLOK2(n,v)                     \
     static int lc_ ## n(lua_State *L)       \
     {                                       \
@@ -128,20 +212,391 @@ static const char *RIPOFF_TABLE        = "curses:ripoffline";
         return 1;                           \
     }
 
+#define LCW_LOCKED_BOOLOK(n)                \
+    static int lcw_ ## n(lua_State *L)      \
+    {                                       \
+        WINDOW *w = lcw_check(L, 1);        \
+        int ret;                            \
+        LC_LOCK();                          \
+        ret = n(w);                         \
+        LC_UNLOCK();                        \
+        lua_pushboolean(L, B(ret));         \
+        return 1;                           \
+    }
+
+
+/*
+** =======================================================
+** module state
+** =======================================================
+*/
+
+/*
+** What the module keeps between calls for a Lua state lives in an
+** lc_state userdata in the state's registry, so that several states
+** can load it.  Only what curses has once per process (its screens,
+** the SIGWINCH handler and the render thread) is kept in statics.
+*/
+#define LC_TRACE_ARGS 4
+
+typedef struct
+{
+    uint64_t time;                      /* monotonic, in nanoseconds */
+    uint64_t window;
+    uint32_t id;
+    uint32_t nargs;
+    int32_t arg[LC_TRACE_ARGS];
+} lc_trace_record;
+
+enum { LC_STAT_DOUPDATE, LC_STAT_WREFRESH, LC_STAT_PREFRESH, LC_STAT_N };
+
+typedef struct
+{
+    double calls, time, bytes, writes;
+} lc_stat;
+
+#define LC_LATENCY_SUB 16
+#define LC_LATENCY_BUCKETS (64 * LC_LATENCY_SUB)
+
+typedef struct
+{
+    /* ripoffline callbacks registered, and called back */
+    int rips, ripped;
+
+    /* profiling and tracing, fixed when the module is loaded */
+    int profiling, tracing;
+    uint32_t call_ids;
+    lc_trace_record *trace_ring;
+    uint64_t trace_size, trace_count;
+
+    /* the headless terminal */
+    SCREEN *headless_screen;
+    FILE *headless_out, *headless_in;
+    int headless_keys;
+
+    /* output statistics */
+    lc_stat stats[LC_STAT_N];
+    lc_stat last_stat;
+    int last_stat_kind;
+    int io_fd;
+
+    /* input latency */
+    double latency_counts[LC_LATENCY_BUCKETS];
+    double latency_n, latency_sum, latency_max;
+    double key_time;                    /* 0 if no key is waiting */
+
+    /* frames */
+    int max_fps;
+    double last_frame;
+} lc_state;
+
+static lc_state *lc_getstate(lua_State *L)
+{
+    lc_state *st;
+
+    lua_pushlightuserdata(L, (void *)&MODULE_STATE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    st = (lc_state *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return st;
+}
 
 /*
 ** =======================================================
 ** privates
 ** =======================================================
 */
+
+/*
+** metatables are also kept in the registry under the address of the
+** variable holding their name, so checking a userdata's type costs a
+** lookup keyed by a light userdata and a pointer compare, rather than
+** interning the type name on every call as luaL_checkudata does
+*/
+static void lc_getmetatable(lua_State *L, const char **tname)
+{
+    lua_pushlightuserdata(L, (void *)tname);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+}
+
+static double lc_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* return the userdata at offset if its metatable is tname's, else NULL */
+static void *lc_toudata(lua_State *L, int offset, const char **tname)
+{
+    void *p = lua_touserdata(L, offset);
+    if (p != NULL && lua_getmetatable(L, offset))
+    {
+        int ok;
+        lc_getmetatable(L, tname);
+        ok = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (ok) return p;
+    }
+    return NULL;
+}
+
+static void *lc_checkudata(lua_State *L, int offset, const char **tname)
+{
+    void *p = lc_toudata(L, offset, tname);
+    if (p == NULL) luaL_typerror(L, offset, *tname);
+    return p;
+}
+
+/*
+** With LCURSES_PROFILE, LCURSES_TRACE or LCURSES_THREADS set in the
+** environment when the module is loaded, every function is registered
+** wrapped in a closure that counts its calls and time, records them in
+** the trace ring, or holds curses_lock; otherwise the functions are
+** registered as they are, and none of this costs anything.
+*/
+typedef struct
+{
+    double calls, time;
+    uint32_t id;                        /* function id in trace dumps */
+    int window;                         /* first argument is a window */
+    int waits;                          /* takes curses_lock itself */
+    lc_state *st;
+} lc_call_entry;
+
+/* functions that wait, and must let curses_lock go while they do */
+static const char *const lc_waiting[] =
+{
+    "wait", "napms", "getch", "mvgetch", "getch_batch", "get_wch",
+    "get_wch_batch", "getstr", "getnstr", "mvgetstr", "get_wstr", NULL
+};
+
+/*
+** the trace ring holds the last trace_size calls, a power of two;
+** trace_count is the number of calls seen in all
+*/
+#define LC_TRACE_DEFAULT 65536
+
+static void lc_trace(lua_State *L, const lc_call_entry *e)
+{
+    lc_state *st = e->st;
+    lc_trace_record *r = &st->trace_ring[st->trace_count++ & (st->trace_size - 1)];
+    struct timespec ts;
+    int i, first = 1, n = lua_gettop(L);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->id = e->id;
+    r->window = 0;
+    if (e->window)
+    {
+        WINDOW **w = lc_toudata(L, 1, &WINDOWMETA);
+        if (w != NULL)
+            r->window = (uintptr_t)*w;
+        /* self is recorded as the window, so not as an argument */
+        if (n > 0)
+        {
+            first = 2;
+            n--;
+        }
+    }
+    r->nargs = n;
+    /* numbers are recorded as integers, other arguments as 0 */
+    for (i = 0; i < LC_TRACE_ARGS; i++)
+        r->arg[i] = i < n && lua_type(L, first + i) == LUA_TNUMBER ?
+            (int32_t)lua_tointeger(L, first + i) : 0;
+}
+
+static int lc_wrapped(lua_State *L)
+{
+    lua_CFunction f = lua_tocfunction(L, lua_upvalueindex(1));
+    lc_call_entry *e = lua_touserdata(L, lua_upvalueindex(2));
+    double start = 0;
+    int n;
+
+    if (e->st->tracing)
+        lc_trace(L, e);
+    if (e->st->profiling)
+    {
+        start = lc_now();
+        e->calls++;
+    }
+#ifdef HAVE_PTHREAD
+    if (locking && !e->waits)
+    {
+        /* an error must not leave the lock held, so call f protected */
+        int err;
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_insert(L, 1);
+        pthread_mutex_lock(&curses_lock);
+        lock_depth++;
+        err = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+        lock_depth--;
+        pthread_mutex_unlock(&curses_lock);
+        if (err != 0)
+            lua_error(L);
+        n = lua_gettop(L);
+    }
+    else
+#endif
+        n = f(L);
+    if (e->st->profiling)
+        e->time += lc_now() - start;
+    return n;
+}
+
+static int lc_wrapping(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+#ifdef HAVE_PTHREAD
+    if (locking)
+        return 1;
+#endif
+    return st->profiling || st->tracing;
+}
+
+/*
+** wrap the functions of lib, already set in the table on top of the
+** stack, recording them in the profile as class..sep..name
+*/
+static void lc_wrap_lib(lua_State *L, const char *class, char sep,
+                        const luaL_reg *lib)
+{
+    lc_state *st = lc_getstate(L);
+    int t = lua_gettop(L), p = t + 1;
+
+    lua_pushlightuserdata(L, (void *)&PROFILE_TABLE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    for (; lib->name != NULL; lib++)
+    {
+        lc_call_entry *e;
+        const char *const *w;
+
+        lua_pushstring(L, lib->name);
+        lua_pushcfunction(L, lib->func);
+        lua_pushfstring(L, "%s%c%s", class, sep, lib->name);
+        e = lua_newuserdata(L, sizeof(lc_call_entry));
+        e->calls = e->time = 0;
+        e->id = st->call_ids++;
+        e->window = strcmp(class, "window") == 0;
+        e->waits = 0;
+        for (w = lc_waiting; *w != NULL; w++)
+            if (strcmp(lib->name, *w) == 0)
+                e->waits = 1;
+        e->st = st;
+        lua_pushvalue(L, -1);
+        lua_insert(L, -3);
+        lua_rawset(L, p);               /* profile[class..sep..name] = e */
+        lua_pushcclosure(L, lc_wrapped, 2);
+        lua_rawset(L, t);               /* t[name] = wrapped function */
+    }
+    lua_pop(L, 1);
+}
+
+static void lc_newmetatable(lua_State *L, const char **tname, const luaL_reg *lib)
+{
+    luaL_newmetatable(L, *tname);
+    lua_pushliteral(L, "__index");
+    lua_pushvalue(L, -2);               /* push metatable */
+    lua_rawset(L, -3);                  /* metatable.__index = metatable */
+    luaL_openlib(L, NULL, lib, 0);
+    if (lc_wrapping(L))
+        lc_wrap_lib(L, strchr(*tname, ':') + 1, ':', lib);
+
+    lua_pushlightuserdata(L, (void *)tname);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pop(L, 1);                      /* remove metatable from stack */
+}
+
+/*
+** each WINDOW* has at most one userdata, found through a weak-valued
+** table keyed by the pointer, so a window passed to Lua repeatedly
+** (stdscr, ripoffline windows) is the same object each time, and only
+** that one object can delete it
+*/
+static void lcw_getcache(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *)&WINDOW_CACHE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+}
+
+/* push a new, empty window cache; each screen has its own */
+static void lcw_newcache(lua_State *L)
+{
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushliteral(L, "__mode");
+    lua_pushliteral(L, "v");
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);            /* setmetatable(cache, {__mode = "v"}) */
+}
+
+/*
+** stdscr, curscr and newscr of every screen belong to curses, and must
+** not be deleted through their objects, even when another screen is
+** current
+*/
+static void lcw_setroots(lua_State *L, int on)
+{
+    WINDOW *roots[3];
+    int i;
+
+    roots[0] = stdscr;
+    roots[1] = curscr;
+    roots[2] = newscr;
+    lua_pushlightuserdata(L, (void *)&ROOT_WINDOWS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    for (i = 0; i < 3; i++)
+        if (roots[i] != NULL)
+        {
+            lua_pushlightuserdata(L, roots[i]);
+            if (on) lua_pushboolean(L, 1); else lua_pushnil(L);
+            lua_rawset(L, -3);
+        }
+    lua_pop(L, 1);
+}
+
+static int lcw_isroot(lua_State *L, WINDOW *w)
+{
+    int root;
+
+    lua_pushlightuserdata(L, (void *)&ROOT_WINDOWS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, w);
+    lua_rawget(L, -2);
+    root = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+    return root;
+}
+
 static void lcw_new(lua_State *L, WINDOW *nw)
 {
     if (nw)
     {
-        WINDOW **w = lua_newuserdata(L, sizeof(WINDOW*));
-        luaL_getmetatable(L, WINDOWMETA);
+        WINDOW **w;
+
+        lcw_getcache(L);
+        lua_pushlightuserdata(L, nw);
+        lua_rawget(L, -2);
+        w = lua_touserdata(L, -1);
+        if (w != NULL && *w == nw)
+        {
+            lua_remove(L, -2);          /* remove cache */
+            return;
+        }
+        lua_pop(L, 1);
+
+        w = lua_newuserdata(L, sizeof(WINDOW*));
+        lc_getmetatable(L, &WINDOWMETA);
         lua_setmetatable(L, -2);
         *w = nw;
+
+        lua_pushlightuserdata(L, nw);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);              /* cache[nw] = w */
+        lua_remove(L, -2);              /* remove cache */
     }
     else
     {
@@ -152,7 +607,7 @@ static void lcw_new(lua_State *L, WINDOW *nw)
 
 static WINDOW **lcw_get(lua_State *L, int offset)
 {
-    WINDOW **w = (WINDOW**)luaL_checkudata(L, offset, WINDOWMETA);
+    WINDOW **w = (WINDOW**)lc_checkudata(L, offset, &WINDOWMETA);
     if (w == NULL) luaL_argerror(L, offset, "bad curses window");
     return w;
 }
@@ -176,6 +631,145 @@ static int lcw_tostring(lua_State *L)
     return 1;
 }
 
+/*
+** =======================================================
+** UTF-8
+** =======================================================
+*/
+
+#ifdef HAVE_NCURSESW
+/*
+** wide characters are Unicode code points, as they are with glibc and
+** ncursesw, and are converted here rather than with the C library so
+** that the result does not depend on the locale
+*/
+
+/* encode c into buf, which has room for 4 bytes; returns the length */
+static int lc_utf8_encode(char *buf, unsigned long c)
+{
+    if (c < 0x80)
+    {
+        buf[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800)
+    {
+        buf[0] = (char)(0xc0 | (c >> 6));
+        buf[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+        c = 0xfffd;
+    if (c < 0x10000)
+    {
+        buf[0] = (char)(0xe0 | (c >> 12));
+        buf[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        buf[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    buf[0] = (char)(0xf0 | (c >> 18));
+    buf[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    buf[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    buf[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+static void lc_utf8_addchar(luaL_Buffer *b, unsigned long c)
+{
+    char buf[4];
+    luaL_addlstring(b, buf, lc_utf8_encode(buf, c));
+}
+
+static void lc_utf8_pushchar(lua_State *L, unsigned long c)
+{
+    char buf[4];
+    lua_pushlstring(L, buf, lc_utf8_encode(buf, c));
+}
+
+/*
+** decode len bytes of src into dst, which has room for len + 1
+** characters, and terminate it; returns the number of characters.
+** A bad sequence decodes as U+FFFD and skips one byte.
+*/
+static size_t lc_utf8_decode(wchar_t *dst, const char *src, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0, n = 0;
+
+    while (i < len)
+    {
+        unsigned long c = s[i], min;
+        size_t need, k;
+
+        if (c < 0x80)
+        {
+            /* ASCII runs are copied 8 bytes at a time */
+            while (i + 8 <= len)
+            {
+                uint64_t block;
+                memcpy(&block, s + i, 8);
+                if (block & UINT64_C(0x8080808080808080))
+                    break;
+                for (k = 0; k < 8; k++)
+                    dst[n + k] = s[i + k];
+                i += 8;
+                n += 8;
+            }
+            while (i < len && s[i] < 0x80)
+                dst[n++] = s[i++];
+            continue;
+        }
+
+        if ((c & 0xe0) == 0xc0)
+            need = 1, c &= 0x1f, min = 0x80;
+        else if ((c & 0xf0) == 0xe0)
+            need = 2, c &= 0x0f, min = 0x800;
+        else if ((c & 0xf8) == 0xf0)
+            need = 3, c &= 0x07, min = 0x10000;
+        else
+            need = 0, min = 0;
+
+        for (k = 1; need > 0 && k <= need; k++)
+        {
+            if (i + k >= len || (s[i + k] & 0xc0) != 0x80)
+                break;
+            c = (c << 6) | (s[i + k] & 0x3f);
+        }
+        if (need == 0 || k <= need || c < min || c > 0x10ffff
+            || (c >= 0xd800 && c < 0xe000))
+        {
+            dst[n++] = 0xfffd;
+            i++;
+        }
+        else
+        {
+            dst[n++] = (wchar_t)c;
+            i += need + 1;
+        }
+    }
+    dst[n] = 0;
+    return n;
+}
+
+/*
+** decode the string argument at offset; short strings go into buf,
+** which has room for LC_WBUF characters, and longer ones into a
+** userdata left on the stack
+*/
+#define LC_WBUF 256
+static wchar_t *lc_checkwstr(lua_State *L, int offset, wchar_t *buf, size_t *n)
+{
+    size_t len;
+    const char *str = luaL_checklstring(L, offset, &len);
+    wchar_t *dst = buf;
+
+    if (len >= LC_WBUF)
+        dst = lua_newuserdata(L, (len + 1) * sizeof(wchar_t));
+    *n = lc_utf8_decode(dst, str, len);
+    return dst;
+}
+#endif
+
 /*
 ** =======================================================
 ** chtype handling
@@ -208,10 +802,16 @@ static chtype lc_optch(lua_State *L, int offset, chtype def)
  *   curses.new_chstr
  ****/
 
+/*
+** str points either at buf, which has room for len cells plus the
+** terminator that winchnstr writes, or into the cells of another
+** chstr when the object is a view (see chstr_view)
+*/
 typedef struct
 {
     unsigned int len;
-    chtype str[1];
+    chtype *str;
+    chtype buf[1];
 } chstr;
 #define CHSTR_SIZE(len) (sizeof(chstr) + len * sizeof(chtype))
 
@@ -226,23 +826,130 @@ static chstr* chstr_new(lua_State *L, int len)
     }
     {
         chstr *cs = lua_newuserdata(L, CHSTR_SIZE(len));
-        luaL_getmetatable(L, CHSTRMETA);
+        lc_getmetatable(L, &CHSTRMETA);
         lua_setmetatable(L, -2);
         cs->len = len;
+        cs->str = cs->buf;
         return cs;
     }
 }
 
+/*
+** create a chstr sharing len cells of str, and keep the object at
+** stack index owner alive for as long as the new one is reachable
+*/
+static chstr* chstr_new_view(lua_State *L, int owner, chtype *str, int len)
+{
+    chstr *cs;
+
+    owner = owner < 0 ? lua_gettop(L) + owner + 1 : owner;
+    cs = lua_newuserdata(L, sizeof(chstr));
+    lc_getmetatable(L, &CHSTRMETA);
+    lua_setmetatable(L, -2);
+    cs->len = len;
+    cs->str = str;
+
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, owner);
+    lua_rawseti(L, -2, 1);
+    lua_setfenv(L, -2);
+    return cs;
+}
+
+/* get chstr from lua, or NULL if the value is not one */
+static chstr* lc_tochstr(lua_State *L, int offset)
+{
+    return (chstr*)lc_toudata(L, offset, &CHSTRMETA);
+}
+
 /* get chstr from lua (convert if needed) */
 static chstr* lc_checkchstr(lua_State *L, int offset)
 {
-    chstr *cs = (chstr*)luaL_checkudata(L, offset, CHSTRMETA);
+    chstr *cs = (chstr*)lc_checkudata(L, offset, &CHSTRMETA);
     if (cs) return cs;
 
     luaL_argerror(L, offset, "bad curses chstr");
     return NULL;
 }
 
+/*
+** fill kernels: the vector paths handle 16 cells per iteration when
+** chtype is 32 bits wide (the ncurses default); other widths and the
+** tail go through the scalar loop.  Define LCURSES_NO_SIMD to build
+** with the scalar loops only.
+*/
+static void chstr_fill_str(chtype *dst, const char *src, size_t n, chtype attr)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    size_t i = 0;
+
+#ifndef LCURSES_NO_SIMD
+#if defined(__AVX2__)
+    if (sizeof(chtype) == 4)
+    {
+        __m256i a = _mm256_set1_epi32((int)attr);
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+            __m256i lo = _mm256_cvtepu8_epi32(b);
+            __m256i hi = _mm256_cvtepu8_epi32(_mm_srli_si128(b, 8));
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(lo, a));
+            _mm256_storeu_si256((__m256i *)(dst + i + 8), _mm256_or_si256(hi, a));
+        }
+    }
+#elif defined(__SSE2__)
+    if (sizeof(chtype) == 4)
+    {
+        __m128i a = _mm_set1_epi32((int)attr);
+        __m128i z = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i lo = _mm_unpacklo_epi8(b, z);
+            __m128i hi = _mm_unpackhi_epi8(b, z);
+            _mm_storeu_si128((__m128i *)(dst + i),
+                             _mm_or_si128(_mm_unpacklo_epi16(lo, z), a));
+            _mm_storeu_si128((__m128i *)(dst + i + 4),
+                             _mm_or_si128(_mm_unpackhi_epi16(lo, z), a));
+            _mm_storeu_si128((__m128i *)(dst + i + 8),
+                             _mm_or_si128(_mm_unpacklo_epi16(hi, z), a));
+            _mm_storeu_si128((__m128i *)(dst + i + 12),
+                             _mm_or_si128(_mm_unpackhi_epi16(hi, z), a));
+        }
+    }
+#endif
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = s[i] | attr;
+}
+
+static void chstr_fill_ch(chtype *dst, chtype ch, size_t n)
+{
+    size_t i = 0;
+
+#ifndef LCURSES_NO_SIMD
+#if defined(__AVX2__)
+    if (sizeof(chtype) == 4)
+    {
+        __m256i c = _mm256_set1_epi32((int)ch);
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_si256((__m256i *)(dst + i), c);
+    }
+#elif defined(__SSE2__)
+    if (sizeof(chtype) == 4)
+    {
+        __m128i c = _mm_set1_epi32((int)ch);
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_si128((__m128i *)(dst + i), c);
+    }
+#endif
+#endif
+
+    for (; i < n; ++i)
+        dst[i] = ch;
+}
+
 /****f* curses/curses.new_chstr
  * FUNCTION
  *   Create a new line drawing buffer instance.
@@ -254,7 +961,7 @@ static int lc_new_chstr(lua_State *L)
 {
     int len = luaL_checkint(L, 1);
     chstr* ncs = chstr_new(L, len);
-    memset(ncs->str, ' ', len*sizeof(chtype));
+    chstr_fill_ch(ncs->str, ' ', len);
     return 1;
 }
 
@@ -264,27 +971,125 @@ static int chstr_set_str(lua_State *L)
     chstr *cs = lc_checkchstr(L, 1);
     int offset = luaL_checkint(L, 2);
     const char *str = luaL_checkstring(L, 3);
-    int len = lua_strlen(L, 3);
-    int attr = (chtype)luaL_optnumber(L, 4, A_NORMAL);
+    size_t len = lua_strlen(L, 3);
+    chtype attr = (chtype)luaL_optnumber(L, 4, A_NORMAL);
     int rep = luaL_optint(L, 5, 1);
-    int i;
+    size_t total, done;
 
-    if (offset < 0)
+    if (offset < 0 || offset >= (int) cs->len || len == 0 || rep < 1)
         return 0;
 
-    while (rep-- > 0 && offset <= (int)cs->len)
-    {
-        if (offset + len - 1 > (int)cs->len)
-            len = cs->len - offset + 1;
+    /* clip to the buffer; the string is truncated on the last repeat */
+    total = cs->len - offset;
+    if (len <= total / rep)
+        total = len * rep;
 
-        for (i = 0; i < len; ++i)
-            cs->str[offset + i] = str[i] | attr;
-        offset += len;
+    /* convert the first copy, then repeat it by doubling the block */
+    done = len < total ? len : total;
+    chstr_fill_str(cs->str + offset, str, done, attr);
+    while (done < total)
+    {
+        size_t n = done < total - done ? done : total - done;
+        memcpy(cs->str + offset + done, cs->str + offset, n * sizeof(chtype));
+        done += n;
     }
 
     return 0;
 }
 
+/****m* chstr/set_str_attrs
+ * FUNCTION
+ *   Set a string in the buffer with a separate attribute for each
+ *   character.
+ *
+ * SYNOPSIS
+ *   chstr:set_str_attrs(offset, string, attrs [, palette])
+ *
+ *   attrs is either a string with one byte per character, or a list
+ *   of {length, attribute} runs.  Each byte of an attribute string
+ *   selects palette[byte]; without a palette the byte is a colour
+ *   pair number.  Characters not covered by attrs get A_NORMAL.
+ *
+ * EXAMPLE
+ *   Draw a keyword in bold followed by a comment in colour pair 2.
+ *       str:set_str_attrs(0, "if -- x", {{2, curses.A_BOLD},
+ *                                        {5, curses.color_pair(2)}})
+ *       str:set_str_attrs(0, "if -- x", "\1\1\2\2\2\2\2",
+ *                         {curses.A_BOLD, curses.color_pair(2)})
+ ****/
+static int chstr_set_str_attrs(lua_State *L)
+{
+    chstr *cs = lc_checkchstr(L, 1);
+    int offset = luaL_checkint(L, 2);
+    const char *str = luaL_checkstring(L, 3);
+    size_t len = lua_strlen(L, 3);
+    size_t i = 0;
+    chtype *dst;
+
+    if (offset < 0 || offset >= (int) cs->len)
+        return 0;
+
+    if (len > cs->len - offset)
+        len = cs->len - offset;
+    dst = cs->str + offset;
+
+    if (lua_type(L, 4) == LUA_TSTRING)
+    {
+        const unsigned char *attrs = (const unsigned char *)lua_tostring(L, 4);
+        size_t alen = lua_strlen(L, 4);
+        int palette = lua_istable(L, 5);
+        chtype pal[256];
+        char seen[256];
+
+        memset(seen, 0, sizeof(seen));
+        for (; i < len && i < alen; ++i)
+        {
+            unsigned char a = attrs[i];
+            if (!seen[a])
+            {
+                if (palette)
+                {
+                    lua_rawgeti(L, 5, a);
+                    pal[a] = (chtype)lua_tonumber(L, -1);
+                    lua_pop(L, 1);
+                }
+                else
+                    pal[a] = COLOR_PAIR(a);
+                seen[a] = 1;
+            }
+            dst[i] = (unsigned char)str[i] | pal[a];
+        }
+    }
+    else if (lua_istable(L, 4))
+    {
+        int r, runs = lua_objlen(L, 4);
+
+        for (r = 1; r <= runs && i < len; ++r)
+        {
+            size_t n;
+            chtype attr;
+
+            lua_rawgeti(L, 4, r);
+            if (!lua_istable(L, -1))
+                return luaL_argerror(L, 4, "attribute runs must be {length, attr} tables");
+            lua_rawgeti(L, -1, 1);
+            lua_rawgeti(L, -2, 2);
+            n = lua_tonumber(L, -2) > 0 ? (size_t)lua_tonumber(L, -2) : 0;
+            attr = (chtype)lua_tonumber(L, -1);
+            lua_pop(L, 3);
+
+            if (n > len - i)
+                n = len - i;
+            chstr_fill_str(dst + i, str + i, n, attr);
+            i += n;
+        }
+    }
+    else
+        luaL_typerror(L, 4, "string or table");
+
+    chstr_fill_str(dst + i, str + i, len - i, A_NORMAL);
+    return 0;
+}
 
 /****m* chstr/set_ch
  * FUNCTION
@@ -306,18 +1111,16 @@ static int chstr_set_ch(lua_State *L)
     chstr* cs = lc_checkchstr(L, 1);
     int offset = luaL_checkint(L, 2);
     chtype ch = lc_checkch(L, 3);
-    int attr = (chtype)luaL_optnumber(L, 4, A_NORMAL);
+    chtype attr = (chtype)luaL_optnumber(L, 4, A_NORMAL);
     int rep = luaL_optint(L, 5, 1);
 
-    while (rep-- > 0)
-    {
-        if (offset < 0 || offset >= (int) cs->len)
-            return 0;
+    if (offset < 0 || offset >= (int) cs->len || rep < 1)
+        return 0;
 
-        cs->str[offset] = ch | attr;
+    if (rep > (int) cs->len - offset)
+        rep = cs->len - offset;
 
-        ++offset;
-    }
+    chstr_fill_ch(cs->str + offset, ch | attr, rep);
     return 0;
 }
 
@@ -339,169 +1142,2577 @@ static int chstr_get(lua_State *L)
     return 3;
 }
 
-/* retrieve chstr length */
-static int chstr_len(lua_State *L)
+/* push the A_CHARTEXT plane of n cells as a string */
+static void chstr_pushtext(lua_State *L, const chtype *str, size_t n)
 {
-    chstr *cs = lc_checkchstr(L, 1);
-    lua_pushnumber(L, cs->len);
-    return 1;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (n > 0)
+    {
+        char *p = luaL_prepbuffer(&b);
+        size_t i, k = n < LUAL_BUFFERSIZE ? n : LUAL_BUFFERSIZE;
+        for (i = 0; i < k; ++i)
+            p[i] = (char)(str[i] & A_CHARTEXT);
+        luaL_addsize(&b, k);
+        str += k;
+        n -= k;
+    }
+    luaL_pushresult(&b);
 }
 
-/* duplicate chstr */
-static int chstr_dup(lua_State *L)
+/****m* chstr/text
+ * FUNCTION
+ *   Return the characters of the buffer, without attributes, as a
+ *   string.
+ *
+ * SYNOPSIS
+ *   chstr:text()
+ ****/
+static int chstr_text(lua_State *L)
+{
+    chstr *cs = lc_checkchstr(L, 1);
+    chstr_pushtext(L, cs->str, cs->len);
+    return 1;
+}
+
+/****m* chstr/runs
+ * FUNCTION
+ *   Return the buffer split into runs of cells with the same
+ *   attributes, as a list of {text, attr, color} triples, where attr
+ *   and color are as returned by chstr:get.
+ *
+ * SYNOPSIS
+ *   chstr:runs()
+ ****/
+static int chstr_runs(lua_State *L)
+{
+    chstr *cs = lc_checkchstr(L, 1);
+    unsigned int i = 0, start;
+    int r = 0;
+
+    lua_newtable(L);
+    while (i < cs->len)
+    {
+        chtype attr = cs->str[i] & A_ATTRIBUTES;
+
+        for (start = i++; i < cs->len && (cs->str[i] & A_ATTRIBUTES) == attr; ++i)
+            ;
+
+        lua_createtable(L, 3, 0);
+        chstr_pushtext(L, cs->str + start, i - start);
+        lua_rawseti(L, -2, 1);
+        lua_pushnumber(L, attr);
+        lua_rawseti(L, -2, 2);
+        lua_pushnumber(L, attr & A_COLOR);
+        lua_rawseti(L, -2, 3);
+        lua_rawseti(L, -2, ++r);
+    }
+    return 1;
+}
+
+/* retrieve chstr length */
+static int chstr_len(lua_State *L)
+{
+    chstr *cs = lc_checkchstr(L, 1);
+    lua_pushnumber(L, cs->len);
+    return 1;
+}
+
+/* duplicate chstr */
+static int chstr_dup(lua_State *L)
+{
+    chstr *cs = lc_checkchstr(L, 1);
+    chstr *ncs = chstr_new(L, cs->len);
+
+    memcpy(ncs->str, cs->str, cs->len * sizeof(chtype));
+    return 1;
+}
+
+/****m* chstr/view
+ * FUNCTION
+ *   Create a view of part of the buffer, without copying it.
+ *
+ * SYNOPSIS
+ *   chstr:view(offset [, len])
+ *
+ *   The view shares its cells with the original buffer, so changes
+ *   made through either are seen by both, and it can be used anywhere
+ *   a chstr can.  len defaults to the rest of the buffer.
+ *
+ * EXAMPLE
+ *   Draw a wide line scrolled horizontally by scroll columns.
+ *       win:mvaddchstr(y, 0, line:view(scroll, cols))
+ ****/
+static int chstr_view(lua_State *L)
+{
+    chstr *cs = lc_checkchstr(L, 1);
+    int offset = luaL_checkint(L, 2);
+    int len = luaL_optint(L, 3, (int) cs->len - offset);
+
+    luaL_argcheck(L, offset >= 0 && offset < (int) cs->len, 2, "offset out of range");
+    if (len > (int) cs->len - offset)
+        len = cs->len - offset;
+    luaL_argcheck(L, len > 0, 3, "invalid chstr length");
+
+    chstr_new_view(L, 1, cs->str + offset, len);
+    return 1;
+}
+
+#ifdef HAVE_NCURSESW
+/****c* classes/wchstr
+ * FUNCTION
+ *   Line drawing buffer of wide character cells, the counterpart of
+ *   chstr for text that is not all single bytes.  Strings passed in
+ *   and returned are UTF-8.
+ *
+ * SEE ALSO
+ *   curses.new_wchstr, chstr
+ ****/
+
+#ifndef CCHARW_MAX
+#define CCHARW_MAX 5
+#endif
+
+typedef struct
+{
+    unsigned int len;
+    cchar_t str[1];
+} wchstr;
+#define WCHSTR_SIZE(len) (sizeof(wchstr) + len * sizeof(cchar_t))
+
+static wchstr *lc_checkwchstr(lua_State *L, int offset)
+{
+    return (wchstr*)lc_checkudata(L, offset, &WCHSTRMETA);
+}
+
+/* set a cell to the characters in wch; attr may carry a COLOR_PAIR */
+static void wchstr_setcell(cchar_t *cc, const wchar_t *wch, attr_t attr)
+{
+    setcchar(cc, wch, attr & ~A_COLOR, (short)PAIR_NUMBER(attr), NULL);
+}
+
+/* fill n cells starting at dst with copies of the first one */
+static void wchstr_repeat(cchar_t *dst, size_t block, size_t n)
+{
+    size_t done = block;
+    while (done < n)
+    {
+        size_t k = done < n - done ? done : n - done;
+        memcpy(dst + done, dst, k * sizeof(cchar_t));
+        done += k;
+    }
+}
+
+/****f* curses/curses.new_wchstr
+ * FUNCTION
+ *   Create a new wide character line drawing buffer.
+ *
+ * SEE ALSO
+ *   wchstr
+ ****/
+static int lc_new_wchstr(lua_State *L)
+{
+    int len = luaL_checkint(L, 1);
+    wchar_t blank[2] = { L' ', 0 };
+    wchstr *ws;
+
+    if (len < 1)
+        return luaL_error(L, "invalid wchstr length");
+    ws = lua_newuserdata(L, WCHSTR_SIZE(len));
+    lc_getmetatable(L, &WCHSTRMETA);
+    lua_setmetatable(L, -2);
+    ws->len = len;
+    wchstr_setcell(ws->str, blank, A_NORMAL);
+    wchstr_repeat(ws->str, 1, len);
+    return 1;
+}
+
+/****m* wchstr/set_str
+ * FUNCTION
+ *   Set a UTF-8 string in the buffer, one character per cell; any
+ *   combining characters share the cell of the character before them.
+ *
+ * SYNOPSIS
+ *   wchstr:set_str(offset, string, attribute [, repeat])
+ ****/
+static int wchstr_set_str(lua_State *L)
+{
+    wchstr *ws = lc_checkwchstr(L, 1);
+    int offset = luaL_checkint(L, 2);
+    wchar_t buf[LC_WBUF], cell[CCHARW_MAX + 1];
+    size_t n, i = 0, pos;
+    wchar_t *wstr = lc_checkwstr(L, 3, buf, &n);
+    attr_t attr = (attr_t)luaL_optnumber(L, 4, A_NORMAL);
+    int rep = luaL_optint(L, 5, 1);
+
+    if (offset < 0 || offset >= (int) ws->len || n == 0 || rep < 1)
+        return 0;
+
+    for (pos = offset; i < n && pos < ws->len; pos++)
+    {
+        size_t k = 0;
+        cell[k++] = wstr[i++];
+        while (i < n && wcwidth(wstr[i]) == 0)
+        {
+            if (k < CCHARW_MAX)
+                cell[k++] = wstr[i];
+            i++;
+        }
+        cell[k] = 0;
+        wchstr_setcell(ws->str + pos, cell, attr);
+    }
+
+    /* repeat the cells just set, truncating the last copy */
+    n = pos - offset;
+    if ((size_t)rep > (ws->len - offset) / n)
+        pos = ws->len;
+    else
+        pos = offset + n * rep;
+    wchstr_repeat(ws->str + offset, n, pos - offset);
+    return 0;
+}
+
+/****m* wchstr/set_ch
+ * FUNCTION
+ *   Set a character, given as a UTF-8 string or a code point, in the
+ *   buffer.
+ *
+ * SYNOPSIS
+ *   wchstr:set_ch(offset, char, attribute [, repeat])
+ ****/
+static int wchstr_set_ch(lua_State *L)
+{
+    wchstr *ws = lc_checkwchstr(L, 1);
+    int offset = luaL_checkint(L, 2);
+    wchar_t buf[LC_WBUF], cell[2];
+    attr_t attr = (attr_t)luaL_optnumber(L, 4, A_NORMAL);
+    int rep = luaL_optint(L, 5, 1);
+
+    if (lua_type(L, 3) == LUA_TNUMBER)
+        cell[0] = (wchar_t)lua_tonumber(L, 3);
+    else
+    {
+        size_t n;
+        cell[0] = lc_checkwstr(L, 3, buf, &n)[0];
+    }
+    cell[1] = 0;
+
+    if (offset < 0 || offset >= (int) ws->len || rep < 1)
+        return 0;
+
+    if (rep > (int) ws->len - offset)
+        rep = ws->len - offset;
+
+    wchstr_setcell(ws->str + offset, cell, attr);
+    wchstr_repeat(ws->str + offset, 1, rep);
+    return 0;
+}
+
+/****m* wchstr/get
+ * FUNCTION
+ *   Return the characters of a cell as a UTF-8 string, its
+ *   attributes, and its color, as chstr:get does.
+ *
+ * SYNOPSIS
+ *   text, attr, color = wchstr:get(offset)
+ ****/
+static int wchstr_get(lua_State *L)
+{
+    wchstr *ws = lc_checkwchstr(L, 1);
+    int offset = luaL_checkint(L, 2);
+    wchar_t wch[CCHARW_MAX + 1];
+    attr_t attr;
+    short pair;
+    luaL_Buffer b;
+    int i;
+
+    if (offset < 0 || offset >= (int) ws->len
+        || getcchar(ws->str + offset, wch, &attr, &pair, NULL) == ERR)
+        return 0;
+
+    luaL_buffinit(L, &b);
+    for (i = 0; wch[i] != 0; i++)
+        lc_utf8_addchar(&b, wch[i]);
+    luaL_pushresult(&b);
+    lua_pushnumber(L, ((attr & ~A_COLOR) | COLOR_PAIR(pair)) & A_ATTRIBUTES);
+    lua_pushnumber(L, COLOR_PAIR(pair));
+    return 3;
+}
+
+/****m* wchstr/text
+ * FUNCTION
+ *   Return the characters of the buffer, without attributes, as a
+ *   UTF-8 string.
+ ****/
+static int wchstr_text(lua_State *L)
+{
+    wchstr *ws = lc_checkwchstr(L, 1);
+    wchar_t wch[CCHARW_MAX + 1];
+    attr_t attr;
+    short pair;
+    luaL_Buffer b;
+    unsigned int i;
+    int k;
+
+    luaL_buffinit(L, &b);
+    for (i = 0; i < ws->len; i++)
+        if (getcchar(ws->str + i, wch, &attr, &pair, NULL) != ERR)
+            for (k = 0; wch[k] != 0; k++)
+                lc_utf8_addchar(&b, wch[k]);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int wchstr_len(lua_State *L)
+{
+    wchstr *ws = lc_checkwchstr(L, 1);
+    lua_pushnumber(L, ws->len);
+    return 1;
+}
+#endif
+
+/****c* classes/grid
+ * FUNCTION
+ *   Rectangular off-screen cell buffer, drawn with window:blit.
+ *
+ * SEE ALSO
+ *   curses.new_grid
+ ****/
+
+/* cells are stored row by row, with one spare cell at the end */
+typedef struct
+{
+    int rows, cols;
+    chtype cells[1];
+} grid;
+#define GRID_CELL(g, y, x) ((g)->cells + (size_t)(y) * (g)->cols + (x))
+
+static grid* lc_checkgrid(lua_State *L, int offset)
+{
+    grid *g = (grid*)lc_checkudata(L, offset, &GRIDMETA);
+    if (g) return g;
+
+    luaL_argerror(L, offset, "bad curses grid");
+    return NULL;
+}
+
+/* get grid from lua, or NULL if the value is not one */
+static grid* lc_togrid(lua_State *L, int offset)
+{
+    return (grid*)lc_toudata(L, offset, &GRIDMETA);
+}
+
+/*
+** clip a h x w rectangle copied from (sy, sx) in a srows x scols area
+** to (dy, dx) in a drows x dcols area; returns false if nothing is left
+*/
+static int lc_clip_rect(int *sy, int *sx, int *dy, int *dx, int *h, int *w,
+                        int srows, int scols, int drows, int dcols)
+{
+    if (*sy < 0) { *dy -= *sy; *h += *sy; *sy = 0; }
+    if (*sx < 0) { *dx -= *sx; *w += *sx; *sx = 0; }
+    if (*dy < 0) { *sy -= *dy; *h += *dy; *dy = 0; }
+    if (*dx < 0) { *sx -= *dx; *w += *dx; *dx = 0; }
+    if (*h > srows - *sy) *h = srows - *sy;
+    if (*h > drows - *dy) *h = drows - *dy;
+    if (*w > scols - *sx) *w = scols - *sx;
+    if (*w > dcols - *dx) *w = dcols - *dx;
+    return *h > 0 && *w > 0;
+}
+
+/****f* curses/curses.new_grid
+ * FUNCTION
+ *   Create a new rows x cols cell buffer, filled with blanks.
+ *
+ * SEE ALSO
+ *   grid
+ ****/
+static int lc_new_grid(lua_State *L)
+{
+    int rows = luaL_checkint(L, 1);
+    int cols = luaL_checkint(L, 2);
+    grid *g;
+
+    luaL_argcheck(L, rows > 0, 1, "invalid grid size");
+    luaL_argcheck(L, cols > 0 && rows <= (int)((~0U >> 1) / sizeof(chtype)) / cols,
+                  2, "invalid grid size");
+
+    g = lua_newuserdata(L, sizeof(grid) + (size_t)rows * cols * sizeof(chtype));
+    lc_getmetatable(L, &GRIDMETA);
+    lua_setmetatable(L, -2);
+    g->rows = rows;
+    g->cols = cols;
+    chstr_fill_ch(g->cells, ' ', (size_t)rows * cols);
+    return 1;
+}
+
+/* retrieve grid size */
+static int grid_size(lua_State *L)
+{
+    grid *g = lc_checkgrid(L, 1);
+    lua_pushnumber(L, g->rows);
+    lua_pushnumber(L, g->cols);
+    return 2;
+}
+
+/* get information from the grid, as chstr:get */
+static int grid_get(lua_State *L)
+{
+    grid *g = lc_checkgrid(L, 1);
+    int y = luaL_checkint(L, 2);
+    int x = luaL_checkint(L, 3);
+    chtype ch;
+
+    if (y < 0 || y >= g->rows || x < 0 || x >= g->cols)
+        return 0;
+
+    ch = *GRID_CELL(g, y, x);
+
+    lua_pushnumber(L, ch & A_CHARTEXT);
+    lua_pushnumber(L, ch & A_ATTRIBUTES);
+    lua_pushnumber(L, ch & A_COLOR);
+    return 3;
+}
+
+/****m* grid/row
+ * FUNCTION
+ *   Return line y of the grid as a chstr view, so it can be written
+ *   and read with the chstr methods.
+ *
+ * SYNOPSIS
+ *   grid:row(y)
+ ****/
+static int grid_row(lua_State *L)
+{
+    grid *g = lc_checkgrid(L, 1);
+    int y = luaL_checkint(L, 2);
+
+    luaL_argcheck(L, y >= 0 && y < g->rows, 2, "row out of range");
+    chstr_new_view(L, 1, GRID_CELL(g, y, 0), g->cols);
+    return 1;
+}
+
+/****m* grid/fill
+ * FUNCTION
+ *   Fill a rectangle of the grid with a character.
+ *
+ * SYNOPSIS
+ *   grid:fill(y, x, h, w, char [, attribute])
+ ****/
+static int grid_fill(lua_State *L)
+{
+    grid *g = lc_checkgrid(L, 1);
+    int y = luaL_checkint(L, 2);
+    int x = luaL_checkint(L, 3);
+    int h = luaL_checkint(L, 4);
+    int w = luaL_checkint(L, 5);
+    chtype ch = lc_checkch(L, 6) | (chtype)luaL_optnumber(L, 7, A_NORMAL);
+    int y2 = y, x2 = x, i;
+
+    if (lc_clip_rect(&y, &x, &y2, &x2, &h, &w, g->rows, g->cols, g->rows, g->cols))
+        for (i = 0; i < h; ++i)
+            chstr_fill_ch(GRID_CELL(g, y + i, x), ch, w);
+    return 0;
+}
+
+/****m* grid/copy
+ * FUNCTION
+ *   Copy a rectangle from another grid (or the same one; the areas
+ *   may overlap).
+ *
+ * SYNOPSIS
+ *   grid:copy(src, sy, sx, dy, dx, h, w)
+ ****/
+static int grid_copy(lua_State *L)
+{
+    grid *g = lc_checkgrid(L, 1);
+    grid *src = lc_checkgrid(L, 2);
+    int sy = luaL_checkint(L, 3);
+    int sx = luaL_checkint(L, 4);
+    int dy = luaL_checkint(L, 5);
+    int dx = luaL_checkint(L, 6);
+    int h = luaL_checkint(L, 7);
+    int w = luaL_checkint(L, 8);
+    int i;
+
+    if (!lc_clip_rect(&sy, &sx, &dy, &dx, &h, &w, src->rows, src->cols, g->rows, g->cols))
+        return 0;
+
+    if (src == g && dy > sy)
+        for (i = h - 1; i >= 0; --i)
+            memmove(GRID_CELL(g, dy + i, dx), GRID_CELL(src, sy + i, sx), w * sizeof(chtype));
+    else
+        for (i = 0; i < h; ++i)
+            memmove(GRID_CELL(g, dy + i, dx), GRID_CELL(src, sy + i, sx), w * sizeof(chtype));
+    return 0;
+}
+
+/****m* grid/scroll
+ * FUNCTION
+ *   Scroll the grid contents up by n lines (down if n is negative),
+ *   filling the lines uncovered with char (a blank by default).
+ *
+ * SYNOPSIS
+ *   grid:scroll(n [, char])
+ ****/
+static int grid_scroll(lua_State *L)
+{
+    grid *g = lc_checkgrid(L, 1);
+    int n = luaL_checkint(L, 2);
+    chtype ch = lc_optch(L, 3, ' ');
+    int keep = g->rows - (n < 0 ? -n : n);
+    size_t cols = g->cols;
+
+    if (keep <= 0)
+        chstr_fill_ch(g->cells, ch, g->rows * cols);
+    else if (n > 0)
+    {
+        memmove(g->cells, GRID_CELL(g, n, 0), keep * cols * sizeof(chtype));
+        chstr_fill_ch(GRID_CELL(g, keep, 0), ch, n * cols);
+    }
+    else if (n < 0)
+    {
+        memmove(GRID_CELL(g, -n, 0), g->cells, keep * cols * sizeof(chtype));
+        chstr_fill_ch(g->cells, ch, -n * cols);
+    }
+    return 0;
+}
+
+/*
+** =======================================================
+** constants
+** =======================================================
+*/
+
+/*
+** the curses table resolves constants on first access through its
+** __index metamethod, and caches them in the table; ACS_ values are
+** only known once curses is initialized, so they are read through a
+** function each and not cached before that
+*/
+#define LC_ACS(n) static chtype lc_ ## n(void) { return n; }
+
+LC_ACS(ACS_BLOCK)
+LC_ACS(ACS_BOARD)
+LC_ACS(ACS_BTEE)
+LC_ACS(ACS_BULLET)
+LC_ACS(ACS_CKBOARD)
+LC_ACS(ACS_DARROW)
+LC_ACS(ACS_DEGREE)
+LC_ACS(ACS_DIAMOND)
+LC_ACS(ACS_GEQUAL)
+LC_ACS(ACS_HLINE)
+LC_ACS(ACS_LANTERN)
+LC_ACS(ACS_LARROW)
+LC_ACS(ACS_LEQUAL)
+LC_ACS(ACS_LLCORNER)
+LC_ACS(ACS_LRCORNER)
+LC_ACS(ACS_LTEE)
+LC_ACS(ACS_NEQUAL)
+LC_ACS(ACS_PI)
+LC_ACS(ACS_PLMINUS)
+LC_ACS(ACS_PLUS)
+LC_ACS(ACS_RARROW)
+LC_ACS(ACS_RTEE)
+LC_ACS(ACS_S1)
+LC_ACS(ACS_S3)
+LC_ACS(ACS_S7)
+LC_ACS(ACS_S9)
+LC_ACS(ACS_STERLING)
+LC_ACS(ACS_TTEE)
+LC_ACS(ACS_UARROW)
+LC_ACS(ACS_ULCORNER)
+LC_ACS(ACS_URCORNER)
+LC_ACS(ACS_VLINE)
+
+typedef struct
+{
+    const char *name;
+    chtype value;
+    chtype (*acs)(void);
+} lc_constant;
+
+#define CC(s)       { #s, s, NULL },
+#define CA(s)       { #s, 0, lc_ ## s },
+
+/* sorted by name, in strcmp order; KEY_F0 to KEY_F63 are computed */
+static const lc_constant lc_constants[] =
+{
+    CA(ACS_BLOCK)
+    CA(ACS_BOARD)
+    CA(ACS_BTEE)
+    CA(ACS_BULLET)
+    CA(ACS_CKBOARD)
+    CA(ACS_DARROW)
+    CA(ACS_DEGREE)
+    CA(ACS_DIAMOND)
+    CA(ACS_GEQUAL)
+    CA(ACS_HLINE)
+    CA(ACS_LANTERN)
+    CA(ACS_LARROW)
+    CA(ACS_LEQUAL)
+    CA(ACS_LLCORNER)
+    CA(ACS_LRCORNER)
+    CA(ACS_LTEE)
+    CA(ACS_NEQUAL)
+    CA(ACS_PI)
+    CA(ACS_PLMINUS)
+    CA(ACS_PLUS)
+    CA(ACS_RARROW)
+    CA(ACS_RTEE)
+    CA(ACS_S1)
+    CA(ACS_S3)
+    CA(ACS_S7)
+    CA(ACS_S9)
+    CA(ACS_STERLING)
+    CA(ACS_TTEE)
+    CA(ACS_UARROW)
+    CA(ACS_ULCORNER)
+    CA(ACS_URCORNER)
+    CA(ACS_VLINE)
+    CC(A_ALTCHARSET)
+    CC(A_ATTRIBUTES)
+    CC(A_BLINK)
+    CC(A_BOLD)
+    CC(A_CHARTEXT)
+    CC(A_COLOR)
+    CC(A_DIM)
+    CC(A_HORIZONTAL)
+    CC(A_INVIS)
+    CC(A_LEFT)
+    CC(A_LOW)
+    CC(A_NORMAL)
+    CC(A_PROTECT)
+    CC(A_REVERSE)
+    CC(A_RIGHT)
+    CC(A_STANDOUT)
+    CC(A_TOP)
+    CC(A_UNDERLINE)
+    CC(A_VERTICAL)
+    CC(COLOR_BLACK)
+    CC(COLOR_BLUE)
+    CC(COLOR_CYAN)
+    CC(COLOR_GREEN)
+    CC(COLOR_MAGENTA)
+    CC(COLOR_RED)
+    CC(COLOR_WHITE)
+    CC(COLOR_YELLOW)
+    CC(KEY_A1)
+    CC(KEY_A3)
+    CC(KEY_B2)
+    CC(KEY_BACKSPACE)
+    CC(KEY_BEG)
+    CC(KEY_BREAK)
+    CC(KEY_BTAB)
+    CC(KEY_C1)
+    CC(KEY_C3)
+    CC(KEY_CANCEL)
+    CC(KEY_CATAB)
+    CC(KEY_CLEAR)
+    CC(KEY_CLOSE)
+    CC(KEY_CODE_YES)
+    CC(KEY_COMMAND)
+    CC(KEY_COPY)
+    CC(KEY_CREATE)
+    CC(KEY_CTAB)
+    CC(KEY_DC)
+    CC(KEY_DL)
+    CC(KEY_DOWN)
+    CC(KEY_EIC)
+    CC(KEY_END)
+    CC(KEY_ENTER)
+    CC(KEY_EOL)
+    CC(KEY_EOS)
+    CC(KEY_EXIT)
+    CC(KEY_FIND)
+    CC(KEY_HELP)
+    CC(KEY_HOME)
+    CC(KEY_IC)
+    CC(KEY_IL)
+    CC(KEY_LEFT)
+    CC(KEY_LL)
+    CC(KEY_MARK)
+    CC(KEY_MAX)
+    CC(KEY_MESSAGE)
+    CC(KEY_MIN)
+    CC(KEY_MOUSE)
+    CC(KEY_MOVE)
+    CC(KEY_NEXT)
+    CC(KEY_NPAGE)
+    CC(KEY_OPEN)
+    CC(KEY_OPTIONS)
+    CC(KEY_PPAGE)
+    CC(KEY_PREVIOUS)
+    CC(KEY_PRINT)
+    CC(KEY_REDO)
+    CC(KEY_REFERENCE)
+    CC(KEY_REFRESH)
+    CC(KEY_REPLACE)
+    CC(KEY_RESET)
+    CC(KEY_RESIZE)
+    CC(KEY_RESTART)
+    CC(KEY_RESUME)
+    CC(KEY_RIGHT)
+    CC(KEY_SAVE)
+    CC(KEY_SBEG)
+    CC(KEY_SCANCEL)
+    CC(KEY_SCOMMAND)
+    CC(KEY_SCOPY)
+    CC(KEY_SCREATE)
+    CC(KEY_SDC)
+    CC(KEY_SDL)
+    CC(KEY_SELECT)
+    CC(KEY_SEND)
+    CC(KEY_SEOL)
+    CC(KEY_SEXIT)
+    CC(KEY_SF)
+    CC(KEY_SFIND)
+    CC(KEY_SHELP)
+    CC(KEY_SHOME)
+    CC(KEY_SIC)
+    CC(KEY_SLEFT)
+    CC(KEY_SMESSAGE)
+    CC(KEY_SMOVE)
+    CC(KEY_SNEXT)
+    CC(KEY_SOPTIONS)
+    CC(KEY_SPREVIOUS)
+    CC(KEY_SPRINT)
+    CC(KEY_SR)
+    CC(KEY_SREDO)
+    CC(KEY_SREPLACE)
+    CC(KEY_SRESET)
+    CC(KEY_SRIGHT)
+    CC(KEY_SRSUME)
+    CC(KEY_SSAVE)
+    CC(KEY_SSUSPEND)
+    CC(KEY_STAB)
+    CC(KEY_SUNDO)
+    CC(KEY_SUSPEND)
+    CC(KEY_UNDO)
+    CC(KEY_UP)
+};
+
+static const lc_constant *lc_findconstant(const char *name)
+{
+    int lo = 0, hi = sizeof(lc_constants) / sizeof(lc_constants[0]) - 1;
+
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(name, lc_constants[mid].name);
+        if (cmp == 0)
+            return &lc_constants[mid];
+        else if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+/* parse the n of KEY_Fn, 0 <= n <= 63; returns -1 for anything else */
+static int lc_keyf(const char *s)
+{
+    int n;
+
+    if (s[0] < '0' || s[0] > '9')
+        return -1;
+    n = s[0] - '0';
+    if (s[1] == '\0')
+        return n;
+    if (n == 0 || s[1] < '0' || s[1] > '9' || s[2] != '\0')
+        return -1;
+    n = n * 10 + s[1] - '0';
+    return n <= 63 ? n : -1;
+}
+
+/*
+** __index for the curses table; upvalue 1 is the __index the table
+** had before (e.g. _G, from module's package.seeall)
+*/
+static int lc_constant_index(lua_State *L)
+{
+    if (lua_type(L, 2) == LUA_TSTRING)
+    {
+        const char *name = lua_tostring(L, 2);
+        const lc_constant *c = lc_findconstant(name);
+        int cache = TRUE, found = TRUE;
+        lua_Number v = 0;
+
+        if (c != NULL && c->acs != NULL)
+        {
+            v = c->acs();
+            cache = stdscr != NULL;
+        }
+        else if (c != NULL)
+            v = c->value;
+        else if (strncmp(name, "KEY_F", 5) == 0 && lc_keyf(name + 5) >= 0)
+            v = KEY_F(lc_keyf(name + 5));
+#ifdef NCURSES_EXT_FUNCS
+        /* keys named by extended terminfo capabilities, e.g. KEY_kUP5 */
+        else if (strncmp(name, "KEY_", 4) == 0 && stdscr != NULL)
+        {
+            char *seq = tigetstr((char *)name + 4);
+            int key = (seq != NULL && seq != (char *)-1) ? key_defined(seq) : 0;
+            found = key > 0;
+            v = key;
+        }
+#endif
+        else
+            found = FALSE;
+
+        if (found)
+        {
+            lua_pushnumber(L, v);
+            if (cache)
+            {
+                lua_pushvalue(L, 2);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, 1);
+            }
+            return 1;
+        }
+    }
+
+    if (lua_isfunction(L, lua_upvalueindex(1)))
+    {
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_call(L, 2, 1);
+    }
+    else if (lua_istable(L, lua_upvalueindex(1)))
+    {
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(1));
+    }
+    else
+        lua_pushnil(L);
+    return 1;
+}
+
+/*
+** =======================================================
+** initscr
+** =======================================================
+*/
+
+/*
+** make sure screen is restored (and cleared) at exit
+** (for the situations where program is aborted without a
+** proper cleanup)
+*/
+static void cleanup(void)
+{
+    lc_render_stop();
+    if (!isendwin())
+    {
+        wclear(stdscr);
+        wrefresh(stdscr);
+        endwin();
+    }
+}
+
+/* screens started and not yet ended; see curses.delscreen */
+static int live_screens = 0;
+
+/* the state starting a screen, for ripoffline's callbacks */
+static lua_State *rip_L = NULL;
+
+/* common tail of initscr, headless and newterm, leaving stdscr on the
+   stack */
+static int lc_started(lua_State *L, WINDOW *w)
+{
+    static int cleanup_installed = 0;
+    lc_state *st = lc_getstate(L);
+
+    /* no longer used, so clean it up */
+    rip_L = NULL;
+    st->rips = st->ripped = 0;
+    lua_pushstring(L, RIPOFF_TABLE);
+    lua_pushnil(L);
+    lua_settable(L, LUA_REGISTRYINDEX);
+
+    /* failed to initialize */
+    if (w == NULL)
+        return 0;
+
+    /* return stdscr - main window */
+    lcw_new(L, w);
+    lcw_setroots(L, 1);
+
+    /* save main window on registry */
+    lua_pushstring(L, STDSCR_REGISTRY);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    /* install cleanup handler to help in debugging and screen trashing,
+       once however many states start screens */
+    LC_LOCK();
+    if (!cleanup_installed)
+    {
+        cleanup_installed = 1;
+        atexit(cleanup);
+    }
+    LC_UNLOCK();
+
+    return 1;
+}
+
+static int lc_initscr(lua_State *L)
+{
+    static int initialized = 0;
+
+    /* curses makes its screen on the first call only */
+    if (!initialized)
+    {
+        initialized = 1;
+        live_screens++;
+    }
+
+    /* initialize curses */
+    rip_L = L;
+    return lc_started(L, initscr());
+}
+
+/*
+** =======================================================
+** headless
+** =======================================================
+*/
+
+/*
+** A headless terminal is a curses screen whose output goes to an
+** unlinked temporary file, which never blocks however much is drawn,
+** and whose input comes from a pipe, so it needs no tty at all.  The
+** escape sequences written can be collected with headless_output, and
+** curscr holds the screen as curses believes the terminal shows it.
+*/
+/****f* curses/curses.headless
+ * FUNCTION
+ *   Initialize curses on an in-memory terminal of the given size,
+ *   instead of the real one; returns stdscr, like initscr.
+ *
+ * SYNOPSIS
+ *   curses.headless(nlines, ncols [, termtype])
+ *
+ *   termtype defaults to "xterm".
+ *
+ * SEE ALSO
+ *   curses.headless_output, curses.headless_input, curses.curscr
+ ****/
+static int lc_headless(lua_State *L)
+{
+    int nlines = luaL_checkint(L, 1);
+    int ncols = luaL_checkint(L, 2);
+    const char *type = luaL_optstring(L, 3, "xterm");
+    lc_state *st = lc_getstate(L);
+    int fds[2];
+
+    if (st->headless_out != NULL)
+        return luaL_error(L, "headless terminal already initialized");
+
+    if (pipe(fds) != 0)
+        return luaL_error(L, "cannot create headless input pipe");
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    st->headless_keys = fds[1];
+    st->headless_in = fdopen(fds[0], "r");
+    st->headless_out = tmpfile();
+
+    rip_L = L;
+    if (st->headless_in == NULL || st->headless_out == NULL
+        || (st->headless_screen = newterm((char *)type, st->headless_out,
+                                          st->headless_in)) == NULL)
+    {
+        if (st->headless_in != NULL) fclose(st->headless_in); else close(fds[0]);
+        if (st->headless_out != NULL) fclose(st->headless_out);
+        close(st->headless_keys);
+        st->headless_in = st->headless_out = NULL;
+        st->headless_keys = -1;
+        rip_L = NULL;
+        return luaL_error(L, "cannot initialize headless terminal `%s'", type);
+    }
+
+    /* the output is not a tty, so the size comes from us; resizeterm
+       queues a KEY_RESIZE, which nobody asked for yet */
+    resizeterm(nlines, ncols);
+    flushinp();
+    live_screens++;
+
+    return lc_started(L, stdscr);
+}
+
+/****f* curses/curses.headless_output
+ * FUNCTION
+ *   Return the bytes written to the headless terminal since the last
+ *   call, and discard them.
+ ****/
+static int lc_headless_output(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+    luaL_Buffer b;
+    int fd;
+    off_t end, pos = 0;
+
+    if (st->headless_out == NULL)
+        return luaL_error(L, "no headless terminal");
+
+    fd = fileno(st->headless_out);
+    end = lseek(fd, 0, SEEK_CUR);
+    luaL_buffinit(L, &b);
+    while (pos < end)
+    {
+        char *p = luaL_prepbuffer(&b);
+        size_t want = end - pos < LUAL_BUFFERSIZE ? (size_t)(end - pos) : LUAL_BUFFERSIZE;
+        ssize_t n = pread(fd, p, want, pos);
+        if (n <= 0)
+            break;
+        luaL_addsize(&b, n);
+        pos += n;
+    }
+    luaL_pushresult(&b);
+
+    /* curses writes through the same file offset, so this rewinds it */
+    if (ftruncate(fd, 0) == 0)
+        lseek(fd, 0, SEEK_SET);
+    return 1;
+}
+
+/****f* curses/curses.headless_input
+ * FUNCTION
+ *   Queue bytes as if typed on the headless terminal; returns the
+ *   number of bytes queued, which is less than asked if the queue is
+ *   full.
+ *
+ * SYNOPSIS
+ *   curses.headless_input(string)
+ ****/
+static int lc_headless_input(lua_State *L)
+{
+    size_t len;
+    const char *str = luaL_checklstring(L, 1, &len);
+    lc_state *st = lc_getstate(L);
+    ssize_t n;
+
+    if (st->headless_keys < 0)
+        return luaL_error(L, "no headless terminal");
+
+    n = len > 0 ? write(st->headless_keys, str, len) : 0;
+    lua_pushnumber(L, n < 0 ? 0 : n);
+    return 1;
+}
+
+/*
+** =======================================================
+** screens
+** =======================================================
+*/
+
+/****c* classes/screen
+ * FUNCTION
+ *   A terminal driven by curses, with its own stdscr and windows.
+ *
+ * SEE ALSO
+ *   curses.newterm, curses.set_term, curses.delscreen
+ ****/
+
+/*
+** A screen object owns the streams newterm was given, and its
+** environment table holds the cache of its windows ([1]) and its
+** stdscr ([2]).  Making a screen current makes its cache current, so
+** each WINDOW pointer maps to an object of the screen that made it.
+** Until it is deleted, a screen object is kept in the LIVE_SCREENS
+** registry table, so a terminal is never ended by the collector.
+*/
+typedef struct
+{
+    SCREEN *sp;
+    FILE *out, *in;
+} lc_screen;
+
+/*
+** Some curses builds, ncurses 6 among them, free the windows of every
+** screen in delscreen, so an ended screen is only freed once no other
+** screen is live.  ncurses 6 no longer touches the streams after
+** endwin, so they are closed at once; older versions flush them in
+** delscreen, so there they wait with the screen.
+*/
+#if defined(NCURSES_VERSION_MAJOR) && NCURSES_VERSION_MAJOR >= 6
+#define LC_CLOSE_ENDED_STREAMS 1
+#endif
+
+typedef struct ended_screen
+{
+    SCREEN *sp;
+    FILE *out, *in;
+    struct ended_screen *next;
+} ended_screen;
+
+static ended_screen *ended_screens = NULL;
+
+static lc_screen *lc_checkscreen(lua_State *L, int offset)
+{
+    lc_screen *s = (lc_screen*)lc_checkudata(L, offset, &SCREENMETA);
+    if (s->sp == NULL) luaL_argerror(L, offset, "attempt to use deleted screen");
+    return s;
+}
+
+/* make the screen object at offset, or none if nil, current */
+static void lc_setcurrent(lua_State *L, int offset)
+{
+    if (offset < 0) offset = lua_gettop(L) + offset + 1;
+
+    lua_pushlightuserdata(L, (void *)&CURRENT_SCREEN);
+    lua_pushvalue(L, offset);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, (void *)&WINDOW_CACHE);
+    if (lua_isnil(L, offset))
+        lcw_newcache(L);
+    else
+    {
+        lua_getfenv(L, offset);
+        lua_rawgeti(L, -1, 1);
+        lua_remove(L, -2);
+    }
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/* wrap the current screen, sp, in a new object using the current
+   window cache, and leave it on the stack */
+static lc_screen *lc_newscreen(lua_State *L, SCREEN *sp, FILE *out, FILE *in)
+{
+    lc_screen *s = lua_newuserdata(L, sizeof(lc_screen));
+    s->sp = sp;
+    s->out = out;
+    s->in = in;
+    lc_getmetatable(L, &SCREENMETA);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, 2, 0);
+    lcw_getcache(L);
+    lua_rawseti(L, -2, 1);
+    lcw_new(L, stdscr);
+    lua_rawseti(L, -2, 2);
+    lua_setfenv(L, -2);
+
+    /* anchor it until it is deleted */
+    lua_pushlightuserdata(L, (void *)&LIVE_SCREENS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L, (void *)&LIVE_SCREENS);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return s;
+}
+
+/* push the current screen object, or nil if there is none */
+static void lc_pushcurrent(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *)&CURRENT_SCREEN);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1) && stdscr != NULL)
+    {
+        /* initscr or headless started it, so it has no object yet, and
+           set_term is the only way to learn its SCREEN pointer */
+        SCREEN *sp;
+        LC_LOCK();
+        sp = set_term(NULL);
+        set_term(sp);
+        LC_UNLOCK();
+        lua_pop(L, 1);
+        lc_newscreen(L, sp, NULL, NULL);
+        lc_setcurrent(L, -1);
+    }
+}
+
+/* check a file descriptor argument, which may be given as a Lua file */
+static int lc_checkfd(lua_State *L, int offset, int def)
+{
+    if (lua_isuserdata(L, offset))
+    {
+        FILE **f = (FILE **)luaL_checkudata(L, offset, LUA_FILEHANDLE);
+        if (*f == NULL) luaL_argerror(L, offset, "attempt to use a closed file");
+        fflush(*f);
+        return fileno(*f);
+    }
+    return luaL_optint(L, offset, def);
+}
+
+static FILE *lc_fdopen(int fd, const char *mode)
+{
+    FILE *f = NULL;
+    if ((fd = dup(fd)) >= 0 && (f = fdopen(fd, mode)) == NULL)
+        close(fd);
+    return f;
+}
+
+/****f* curses/curses.newterm
+ * FUNCTION
+ *   Start curses on another terminal, and make it the current screen;
+ *   returns the new screen, and the screen that was current, if any.
+ *
+ * SYNOPSIS
+ *   curses.newterm([termtype [, outfd [, infd]]])
+ *
+ *   termtype defaults to $TERM; outfd and infd are file descriptors
+ *   or Lua files, and default to standard output and input.  They are
+ *   duplicated, so may be closed once the screen is made.
+ *
+ * SEE ALSO
+ *   curses.set_term, curses.delscreen, newterm(3)
+ ****/
+static int lc_newterm(lua_State *L)
+{
+    const char *type = luaL_optstring(L, 1, NULL);
+    int outfd = lc_checkfd(L, 2, STDOUT_FILENO);
+    int infd = lc_checkfd(L, 3, STDIN_FILENO);
+    FILE *out = lc_fdopen(outfd, "w");
+    FILE *in = lc_fdopen(infd, "r");
+    SCREEN *sp = NULL;
+
+    /* give the screen being left an object, so set_term can return to
+       it with its windows */
+    lc_pushcurrent(L);
+
+    lc_render_stop();
+    rip_L = L;
+    if (out == NULL || in == NULL
+        || (sp = newterm((char *)type, out, in)) == NULL)
+    {
+        rip_L = NULL;
+        if (out != NULL) fclose(out);
+        if (in != NULL) fclose(in);
+        return luaL_error(L, "cannot initialize terminal `%s'",
+                          type ? type : getenv("TERM"));
+    }
+    live_screens++;
+
+    /* the new screen gets a new window cache */
+    lua_pushlightuserdata(L, (void *)&WINDOW_CACHE);
+    lcw_newcache(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lc_started(L, stdscr);
+    lua_pop(L, 1);
+
+    lc_newscreen(L, sp, out, in);
+    lc_setcurrent(L, -1);
+    lua_insert(L, -2);
+    return 2;
+}
+
+/****f* curses/curses.screen
+ * FUNCTION
+ *   Return the current screen, or nil if there is none.
+ *
+ *   The screen started by initscr or headless gets an object the
+ *   first time it is returned here or by set_term, or when newterm
+ *   starts another screen.
+ ****/
+static int lc_screen_current(lua_State *L)
+{
+    lc_pushcurrent(L);
+    return 1;
+}
+
+/****f* curses/curses.set_term
+ * FUNCTION
+ *   Make screen current; returns the screen that was current, if any.
+ *
+ * SYNOPSIS
+ *   curses.set_term(screen)
+ ****/
+static int lc_set_term(lua_State *L)
+{
+    lc_screen *s = lc_checkscreen(L, 1);
+
+    lc_pushcurrent(L);
+    lc_render_stop();
+    set_term(s->sp);
+    lc_setcurrent(L, 1);
+    return 1;
+}
+
+/****f* curses/curses.delscreen
+ * FUNCTION
+ *   End screen, and close its windows.
+ *
+ * SYNOPSIS
+ *   curses.delscreen(screen)
+ *
+ *   screen:close() does the same.  The screen's terminal and streams
+ *   are released at once, but curses frees the screen itself only
+ *   when no other screen is live, so a process that keeps one screen
+ *   live while others come and go holds the memory of every screen it
+ *   has ended.  If screen was current, no screen is current
+ *   afterwards.
+ *
+ *   A screen is never ended by garbage collection; it stays live
+ *   until it is deleted.
+ ****/
+static int lc_delscreen(lua_State *L)
+{
+    lc_screen *s = (lc_screen*)lc_checkudata(L, 1, &SCREENMETA);
+    ended_screen *e;
+    SCREEN *cur;
+#ifndef LC_CLOSE_ENDED_STREAMS
+    int null;
+#endif
+
+    if (s->sp == NULL)
+        return 0;
+
+    /* end it, and forget curses' own windows */
+    lc_render_stop();
+    cur = set_term(s->sp);
+    if (!isendwin())
+        endwin();
+    lcw_setroots(L, 0);
+
+    /* curses frees its windows, so close their objects */
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, 1);
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+        WINDOW **w = (WINDOW **)lc_toudata(L, -1, &WINDOWMETA);
+        if (w != NULL) *w = NULL;
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+
+    if (cur == s->sp)
+    {
+        set_term(NULL);
+        lua_pushnil(L);
+        lc_setcurrent(L, -1);
+        lua_pop(L, 1);
+    }
+    else
+        set_term(cur);
+
+#ifdef LC_CLOSE_ENDED_STREAMS
+    if (s->out != NULL) fclose(s->out);
+    if (s->in != NULL) fclose(s->in);
+    s->out = s->in = NULL;
+#else
+    /* keep the streams valid for curses, but let go of the terminal */
+    if ((null = open("/dev/null", O_RDWR)) >= 0)
+    {
+        if (s->out != NULL) dup2(null, fileno(s->out));
+        if (s->in != NULL) dup2(null, fileno(s->in));
+        close(null);
+    }
+#endif
+
+    e = malloc(sizeof(ended_screen));
+    if (e != NULL)
+    {
+        e->sp = s->sp;
+        e->out = s->out;
+        e->in = s->in;
+        e->next = ended_screens;
+        ended_screens = e;
+    }
+    s->sp = NULL;
+    s->out = s->in = NULL;
+
+    /* no longer live, so the collector may have it */
+    lua_pushlightuserdata(L, (void *)&LIVE_SCREENS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, -1))
+    {
+        lua_pushvalue(L, 1);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+    }
+    lua_pop(L, 1);
+
+    if (--live_screens == 0)
+    {
+        /* no windows are left that curses could free by mistake */
+        set_term(NULL);
+        while ((e = ended_screens) != NULL)
+        {
+            ended_screens = e->next;
+            delscreen(e->sp);
+            if (e->out != NULL) fclose(e->out);
+            if (e->in != NULL) fclose(e->in);
+            free(e);
+        }
+    }
+    return 0;
+}
+
+/****m* screen/stdscr
+ * FUNCTION
+ *   Return the screen's stdscr.
+ ****/
+static int lcs_stdscr(lua_State *L)
+{
+    lc_checkscreen(L, 1);
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, 2);
+    return 1;
+}
+
+static int lcs_tostring(lua_State *L)
+{
+    lc_screen *s = (lc_screen*)lc_checkudata(L, 1, &SCREENMETA);
+    if (s->sp == NULL)
+        lua_pushliteral(L, "curses screen (deleted)");
+    else
+        lua_pushfstring(L, "curses screen (%p)", lua_touserdata(L, 1));
+    return 1;
+}
+
+/*
+** =======================================================
+** event loop
+** =======================================================
+*/
+
+/*
+** SIGWINCH is turned into a byte on a non-blocking pipe, which wait
+** polls along with everything else.  Curses installs its own handler
+** when a screen starts, unless one is set already, and that handler is
+** what queues KEY_RESIZE; so ours is only installed once a screen has
+** started, and passes the signal on.
+*/
+static int winch_pipe[2] = { -1, -1 };
+static struct sigaction winch_old;
+static volatile sig_atomic_t winch_held = 0;
+
+/* pass the signal on to the handler ours replaced */
+static void lc_winch_pass(int sig, siginfo_t *info, void *context)
+{
+    if (winch_old.sa_flags & SA_SIGINFO)
+    {
+        if (winch_old.sa_sigaction != NULL)
+            winch_old.sa_sigaction(sig, info, context);
+    }
+    else if (winch_old.sa_handler != SIG_DFL && winch_old.sa_handler != SIG_IGN)
+        winch_old.sa_handler(sig);
+}
+
+static void lc_winch(int sig, siginfo_t *info, void *context)
+{
+    int saved = errno;
+    char c = 0;
+
+    /* a full pipe already says the same thing */
+    if (write(winch_pipe[1], &c, 1) < 0) {}
+    errno = saved;
+
+#ifdef HAVE_PTHREAD
+    /* curses would resize the windows in the render thread's doupdate,
+       under the feet of whoever is drawing in them, so the signal is
+       held back for lc_render_winch to pass on with the lock held */
+    if (render_running)
+    {
+        winch_held = 1;
+        return;
+    }
+#endif
+    lc_winch_pass(sig, info, context);
+}
+
+static int lc_winch_install(void)
+{
+    struct sigaction sa;
+
+    if (winch_pipe[0] >= 0)
+        return 1;
+    if (stdscr == NULL || pipe(winch_pipe) != 0)
+        return 0;
+    fcntl(winch_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(winch_pipe[1], F_SETFL, O_NONBLOCK);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = lc_winch;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, &winch_old) != 0)
+    {
+        close(winch_pipe[0]);
+        close(winch_pipe[1]);
+        winch_pipe[0] = winch_pipe[1] = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/* the descriptor curses reads the current screen's keys from */
+static int lc_inputfd(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+    lc_screen *s;
+    int fd = STDIN_FILENO;
+
+    lc_pushcurrent(L);
+    s = (lc_screen*)lc_toudata(L, -1, &SCREENMETA);
+    if (s != NULL && s->in != NULL)
+        fd = fileno(s->in);
+    else if (s != NULL && s->sp == st->headless_screen)
+        fd = fileno(st->headless_in);
+    lua_pop(L, 1);
+    return fd;
+}
+
+/****f* curses/curses.input_fd
+ * FUNCTION
+ *   Return the file descriptor the current screen reads keys from,
+ *   for use with an event loop.
+ *
+ * SEE ALSO
+ *   curses.wait
+ ****/
+static int lc_input_fd(lua_State *L)
+{
+    lua_pushnumber(L, lc_inputfd(L));
+    return 1;
+}
+
+/****f* curses/curses.wait
+ * FUNCTION
+ *   Sleep until the terminal has input, the terminal has been
+ *   resized, one of fds is readable, or timeout milliseconds have
+ *   passed; returns whether there is input, whether there was a
+ *   resize, and a list of the readable fds.
+ *
+ * SYNOPSIS
+ *   input, resized, ready = curses.wait([fds [, timeout]])
+ *
+ *   fds is a list of file descriptors or Lua files; timeout defaults
+ *   to waiting for ever.  A signal may end the wait early.
+ *
+ *   Keys that curses has read but not yet returned, such as those
+ *   pushed back with ungetch, do not count as input, so read with
+ *   getch in no-delay mode until it returns nil before waiting.
+ *   Resizes are only seen once a screen has started; curses still
+ *   queues KEY_RESIZE for them.
+ *
+ *   While the render thread runs, a frame curses.submit_frame had to
+ *   drop is submitted again once the thread has written the last one,
+ *   and a resize is applied to the windows before wait returns.
+ *
+ * SEE ALSO
+ *   curses.input_fd, poll(2)
+ ****/
+static int lc_wait(lua_State *L)
+{
+    int timeout = luaL_optint(L, 2, -1);
+    int nfds = 0, i, n, ready;
+    struct pollfd *fds;
+#ifdef HAVE_PTHREAD
+    double deadline = lc_now() + timeout / 1000.0;
+#endif
+
+    if (!lua_isnoneornil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        nfds = lua_objlen(L, 1);
+    }
+
+    /* the terminal, the resize pipe, the render thread's pipe, then
+       the user's descriptors */
+    fds = lua_newuserdata(L, (nfds + 3) * sizeof(struct pollfd));
+    fds[0].fd = lc_inputfd(L);
+    LC_LOCK();
+    fds[1].fd = lc_winch_install() ? winch_pipe[0] : -1;
+    LC_UNLOCK();
+#ifdef HAVE_PTHREAD
+    fds[2].fd = render_running ? render_pipe[0] : -1;
+#else
+    fds[2].fd = -1;
+#endif
+    for (i = 0; i < nfds; i++)
+    {
+        lua_rawgeti(L, 1, i + 1);
+        if (!lua_isnumber(L, -1) && !lua_isuserdata(L, -1))
+            return luaL_error(L, "wait: bad file descriptor at fds[%d]", i + 1);
+        fds[i + 3].fd = lc_checkfd(L, -1, -1);
+        lua_pop(L, 1);
+    }
+    for (i = 0; i < nfds + 3; i++)
+    {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+
+    for (;;)
+    {
+        n = poll(fds, nfds + 3, timeout);
+        /* something may have become ready with the signal */
+        if (n < 0 && errno == EINTR)
+            n = poll(fds, nfds + 3, 0);
+        if (n < 0)
+            return luaL_error(L, "wait: %s", strerror(errno));
+
+#ifdef HAVE_PTHREAD
+        /* the render thread has written a frame: submit one it had to
+           drop, and wait on */
+        if (fds[2].revents & POLLIN)
+        {
+            char buf[64];
+            while (read(render_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+            if (render_deferred)
+                lc_render_submit(L);
+            if (n == 1 && timeout != 0)
+            {
+                if (timeout > 0 && (timeout = (int)((deadline - lc_now()) * 1000)) <= 0)
+                    timeout = 0;
+                fds[2].revents = 0;
+                continue;
+            }
+        }
+#endif
+        break;
+    }
+
+    ready = POLLIN | POLLHUP | POLLERR;
+    lua_pushboolean(L, fds[0].revents & ready);
+    if (fds[1].revents & ready)
+    {
+        char buf[64];
+        while (read(winch_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+        lc_render_winch();
+        lua_pushboolean(L, 1);
+    }
+    else
+        lua_pushboolean(L, 0);
+    lua_newtable(L);
+    for (i = 0, n = 0; i < nfds; i++)
+        if (fds[i + 3].revents & ready)
+        {
+            lua_rawgeti(L, 1, i + 1);
+            lua_rawseti(L, -2, ++n);
+        }
+    return 3;
+}
+
+/*
+** =======================================================
+** input latency
+** =======================================================
+*/
+
+/*
+** The time from a key being read to the end of the next refresh that
+** writes to the terminal is kept in a histogram of microseconds, with
+** LC_LATENCY_SUB buckets for each power of two, so that any latency is
+** counted to within about 6% in a fixed table.  Keys read while an
+** earlier key is waiting for a refresh are counted from that key.
+** Without the I/O counters (see lc_io_counters), what a refresh wrote
+** is unknown, so the next refresh of any kind ends the wait.
+*/
+static void lc_keypressed(lc_state *st)
+{
+    LC_LOCK();
+    if (st->key_time == 0)
+        st->key_time = lc_now();
+    LC_UNLOCK();
+}
+
+static unsigned lc_latency_bucket(uint64_t us)
+{
+    unsigned shift = 0;
+    while ((us >> shift) >= 2 * LC_LATENCY_SUB)
+        shift++;
+    return shift * LC_LATENCY_SUB + (unsigned)(us >> shift);
+}
+
+/* the largest latency in microseconds counted in bucket i */
+static double lc_latency_upper(unsigned i)
+{
+    unsigned shift = i < 2 * LC_LATENCY_SUB ? 0 : i / LC_LATENCY_SUB - 1;
+    uint64_t m = i - shift * LC_LATENCY_SUB;
+    return (double)(((m + 1) << shift) - 1);
+}
+
+/* count the latency of a key waiting for a refresh that ended at now */
+static void lc_latency_end(lc_state *st, double now)
+{
+    double t;
+
+    if (st->key_time == 0)
+        return;
+    t = now - st->key_time;
+    st->key_time = 0;
+    st->latency_counts[lc_latency_bucket((uint64_t)(t * 1e6))]++;
+    st->latency_n++;
+    st->latency_sum += t;
+    if (t > st->latency_max)
+        st->latency_max = t;
+}
+
+static double lc_latency_percentile(const lc_state *st, double p)
+{
+    double target = p * st->latency_n, seen = 0;
+    unsigned i;
+
+    for (i = 0; i < LC_LATENCY_BUCKETS; i++)
+    {
+        seen += st->latency_counts[i];
+        if (seen >= target && seen > 0)
+        {
+            double t = lc_latency_upper(i) / 1e6;
+            return t < st->latency_max ? t : st->latency_max;
+        }
+    }
+    return st->latency_max;
+}
+
+/****f* curses/curses.latency_stats
+ * FUNCTION
+ *   Return statistics of the time from reading a key with getch or
+ *   get_wch to the end of the next doupdate, wrefresh or prefresh that
+ *   writes to the terminal: a table of count, and, if count is not
+ *   zero, mean, p50, p90, p99 and max, in seconds.  Percentiles are
+ *   accurate to about 6%.
+ *
+ *   Where curses.stats has no byte counts, any refresh counts, even
+ *   one that writes nothing.
+ *
+ * SEE ALSO
+ *   curses.stats, curses.reset_stats
+ ****/
+static int lc_latency_stats(lua_State *L)
 {
-    chstr *cs = lc_checkchstr(L, 1);
-    chstr *ncs = chstr_new(L, cs->len);
+    lc_state *st = lc_getstate(L);
+    double n, mean = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
 
-    memcpy(ncs->str, cs->str, CHSTR_SIZE(cs->len));
+    LC_LOCK();
+    n = st->latency_n;
+    if (n > 0)
+    {
+        mean = st->latency_sum / st->latency_n;
+        p50 = lc_latency_percentile(st, 0.5);
+        p90 = lc_latency_percentile(st, 0.9);
+        p99 = lc_latency_percentile(st, 0.99);
+        max = st->latency_max;
+    }
+    LC_UNLOCK();
+
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, n);
+    lua_setfield(L, -2, "count");
+    if (n > 0)
+    {
+        lua_pushnumber(L, mean);
+        lua_setfield(L, -2, "mean");
+        lua_pushnumber(L, p50);
+        lua_setfield(L, -2, "p50");
+        lua_pushnumber(L, p90);
+        lua_setfield(L, -2, "p90");
+        lua_pushnumber(L, p99);
+        lua_setfield(L, -2, "p99");
+        lua_pushnumber(L, max);
+        lua_setfield(L, -2, "max");
+    }
     return 1;
 }
 
 /*
 ** =======================================================
-** initscr
+** output statistics
 ** =======================================================
 */
 
-#define CCR(n, v)                       \
-    lua_pushstring(L, n);               \
-    lua_pushnumber(L, v);               \
-    lua_settable(L, lua_upvalueindex(1));
+/*
+** curses writes to the terminal with write(2) on the descriptor of
+** its output stream, so there is no stream to wrap; instead the bytes
+** and write calls made during each refresh are read from the calling
+** thread's I/O counters in /proc, where the system has them.  Time is
+** always counted.  Output from refreshes that getch does implicitly
+** is not counted.
+*/
+static const char *const lc_stat_names[LC_STAT_N] =
+    { "doupdate", "wrefresh", "prefresh" };
+
+/* the counters when a refresh started */
+typedef struct
+{
+    double time, bytes, writes;
+    int io;
+    int *fd;                            /* the counters' file */
+} lc_sample;
+
+/* read the wchar and syscw counters of the thread that opened *fd */
+static int lc_io_counters(int *fd, double *bytes, double *writes)
+{
+    char buf[512], *b, *w;
+    ssize_t n;
+
+    if (*fd == -2)
+    {
+        *fd = open("/proc/thread-self/io", O_RDONLY);
+        if (*fd < 0)
+            *fd = open("/proc/self/io", O_RDONLY);
+        if (*fd >= 0)
+            fcntl(*fd, F_SETFD, FD_CLOEXEC);
+    }
+    if (*fd < 0 || (n = pread(*fd, buf, sizeof(buf) - 1, 0)) <= 0)
+        return 0;
+    buf[n] = '\0';
+    if ((b = strstr(buf, "wchar:")) == NULL || (w = strstr(buf, "syscw:")) == NULL)
+        return 0;
+    *bytes = strtod(b + 6, NULL);
+    *writes = strtod(w + 6, NULL);
+    return 1;
+}
+
+/* each thread that refreshes has its own counters file */
+static void lc_stat_begin_fd(lc_sample *s, int *fd)
+{
+    s->fd = fd;
+    s->io = lc_io_counters(fd, &s->bytes, &s->writes);
+    s->time = lc_now();
+}
+
+static void lc_stat_begin(lc_state *st, lc_sample *s)
+{
+    lc_stat_begin_fd(s, &st->io_fd);
+}
+
+static void lc_stat_end(lc_state *st, int kind, const lc_sample *s)
+{
+    lc_stat *stat = &st->stats[kind], *last = &st->last_stat;
+    double bytes, writes, now = lc_now();
+    int io = s->io && lc_io_counters(s->fd, &bytes, &writes);
+
+    last->time = now - s->time;
+    if (io)
+    {
+        last->bytes = bytes - s->bytes;
+        last->writes = writes - s->writes;
+    }
+    else
+        last->bytes = last->writes = 0;
+    last->calls = 1;
+    st->last_stat_kind = kind;
+
+    stat->calls++;
+    stat->time += last->time;
+    stat->bytes += last->bytes;
+    stat->writes += last->writes;
+    /* a refresh that wrote nothing has not shown the key yet */
+    if (!io || last->bytes > 0)
+        lc_latency_end(st, now);
+}
+
+static void lc_pushstat(lua_State *L, const lc_stat *stat, int io)
+{
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, stat->calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushnumber(L, stat->time);
+    lua_setfield(L, -2, "time");
+    if (io)
+    {
+        lua_pushnumber(L, stat->bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushnumber(L, stat->writes);
+        lua_setfield(L, -2, "writes");
+    }
+}
+
+/****f* curses/curses.stats
+ * FUNCTION
+ *   Return the output statistics of the refresh functions: a table
+ *   with a field for each of doupdate, wrefresh (also refresh) and
+ *   prefresh, one for their total, and one for the last call, each
+ *   holding calls, time (seconds), and where the system counts them,
+ *   bytes and writes (write system calls).  last.call names the
+ *   function that was called last.
+ *
+ * SEE ALSO
+ *   curses.reset_stats
+ ****/
+static int lc_stats(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+    lc_stat copy[LC_STAT_N], total, last;
+    int i, last_kind, io;
+
+    LC_LOCK();
+    io = st->io_fd >= 0;
+    memcpy(copy, st->stats, sizeof(copy));
+    last = st->last_stat;
+    last_kind = st->last_stat_kind;
+    LC_UNLOCK();
+
+    memset(&total, 0, sizeof(total));
+    lua_createtable(L, 0, LC_STAT_N + 2);
+    for (i = 0; i < LC_STAT_N; i++)
+    {
+        total.calls += copy[i].calls;
+        total.time += copy[i].time;
+        total.bytes += copy[i].bytes;
+        total.writes += copy[i].writes;
+        lc_pushstat(L, &copy[i], io);
+        lua_setfield(L, -2, lc_stat_names[i]);
+    }
+    lc_pushstat(L, &total, io);
+    lua_setfield(L, -2, "total");
+    if (last_kind >= 0)
+    {
+        lc_pushstat(L, &last, io);
+        lua_pushstring(L, lc_stat_names[last_kind]);
+        lua_setfield(L, -2, "call");
+        lua_setfield(L, -2, "last");
+    }
+    return 1;
+}
+
+/****f* curses/curses.reset_stats
+ * FUNCTION
+ *   Set the counters returned by curses.stats and curses.latency_stats
+ *   to zero.
+ ****/
+static int lc_reset_stats(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+
+    LC_LOCK();
+    memset(st->stats, 0, sizeof(st->stats));
+    memset(&st->last_stat, 0, sizeof(st->last_stat));
+    st->last_stat_kind = -1;
+    memset(st->latency_counts, 0, sizeof(st->latency_counts));
+    st->latency_n = st->latency_sum = st->latency_max = 0;
+    st->key_time = 0;
+    LC_UNLOCK();
+    return 0;
+}
 
-#define CC(s)       CCR(#s, s)
-#define CC2(s, v)   CCR(#s, v)
+/*
+** =======================================================
+** frames
+** =======================================================
+*/
 
 /*
-** these values may be fixed only after initialization, so this is
-** called from lc_initscr, after the curses driver is initialized
-**
-** curses table is kept at upvalue position 1, in case the global
-** name is changed by the user or even in the registration phase by
-** the developer
-**
-** some of these values are not constant so need to register
-** them directly instead of using a table
+** Windows marked for the next frame are kept in order in the array
+** part of a registry table, whose hash part maps each window back to
+** its index so that marking twice queues once.
 */
-static void register_curses_constants(lua_State *L)
+static void lc_getmarked(lua_State *L)
 {
-    /* colors */
-    CC(COLOR_BLACK)     CC(COLOR_RED)       CC(COLOR_GREEN)
-    CC(COLOR_YELLOW)    CC(COLOR_BLUE)      CC(COLOR_MAGENTA)
-    CC(COLOR_CYAN)      CC(COLOR_WHITE)
+    lua_pushlightuserdata(L, (void *)&MARKED_WINDOWS);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L, (void *)&MARKED_WINDOWS);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+}
 
-    /* alternate character set */
-    CC(ACS_BLOCK)       CC(ACS_BOARD)
+/* wnoutrefresh the n marked windows, whose table is on top of the stack */
+static void lc_noutrefresh_marked(lua_State *L, int n)
+{
+    int i;
+
+    for (i = 1; i <= n; i++)
+    {
+        WINDOW **w;
+        lua_rawgeti(L, -1, i);
+        w = (WINDOW **)lc_toudata(L, -1, &WINDOWMETA);
+        if (w != NULL && *w != NULL)
+            wnoutrefresh(*w);
+        lua_pop(L, 1);
+    }
+}
 
-    CC(ACS_BTEE)        CC(ACS_TTEE)
-    CC(ACS_LTEE)        CC(ACS_RTEE)
-    CC(ACS_LLCORNER)    CC(ACS_LRCORNER)
-    CC(ACS_URCORNER)    CC(ACS_ULCORNER)
+/* start the next frame's queue afresh */
+static void lc_resetmarked(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void *)&MARKED_WINDOWS);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
 
-    CC(ACS_LARROW)      CC(ACS_RARROW)
-    CC(ACS_UARROW)      CC(ACS_DARROW)
+/****m* window/mark
+ * FUNCTION
+ *   Queue the window to be refreshed by the next curses.frame, rather
+ *   than refreshing it now.  Windows are refreshed in the order they
+ *   were first marked.
+ *
+ * SEE ALSO
+ *   curses.frame
+ ****/
+static int lcw_mark(lua_State *L)
+{
+    lcw_check(L, 1);
+    lc_getmarked(L);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
+    {
+        int n = lua_objlen(L, -2) + 1;
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -3, n);
+        lua_pushvalue(L, 1);
+        lua_pushnumber(L, n);
+        lua_rawset(L, -4);
+    }
+    return 0;
+}
 
-    CC(ACS_HLINE)       CC(ACS_VLINE)
+/****f* curses/curses.frame
+ * FUNCTION
+ *   Refresh the marked windows with one wnoutrefresh each and a single
+ *   doupdate; returns true if a frame was drawn.
+ *
+ *   If a frame rate limit is set, a frame that comes too soon after
+ *   the last one while keys are waiting is dropped, as another will
+ *   follow once they are read; it then returns false and the number
+ *   of milliseconds until a frame is due.  force draws regardless.
+ *   Nothing is drawn if no window is marked.
+ *
+ * SYNOPSIS
+ *   curses.frame([force])
+ *
+ * SEE ALSO
+ *   window:mark, curses.max_fps
+ ****/
+static int lc_frame(lua_State *L)
+{
+    int force = lua_toboolean(L, 1);
+    lc_state *st = lc_getstate(L);
+    lc_sample sample;
+    double now;
+    int n;
 
-    CC(ACS_BULLET)      CC(ACS_CKBOARD)     CC(ACS_LANTERN)
-    CC(ACS_DEGREE)      CC(ACS_DIAMOND)
+    lc_getmarked(L);
+    n = lua_objlen(L, -1);
+    if (n == 0)
+    {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
 
-    CC(ACS_PLMINUS)     CC(ACS_PLUS)
-    CC(ACS_S1)          CC(ACS_S9)
+    now = lc_now();
+    if (!force && st->max_fps > 0 && now - st->last_frame < 1.0 / st->max_fps)
+    {
+        struct pollfd in;
+        in.fd = lc_inputfd(L);
+        in.events = POLLIN;
+        if (poll(&in, 1, 0) > 0)
+        {
+            lua_pushboolean(L, 0);
+            lua_pushnumber(L, (int)((st->last_frame + 1.0 / st->max_fps - now) * 1000) + 1);
+            return 2;
+        }
+    }
 
-    /* attributes */
-    CC(A_NORMAL)        CC(A_STANDOUT)      CC(A_UNDERLINE)
-    CC(A_REVERSE)       CC(A_BLINK)         CC(A_DIM)
-    CC(A_BOLD)          CC(A_PROTECT)       CC(A_INVIS)
-    CC(A_ALTCHARSET)    CC(A_CHARTEXT)
-    CC(A_ATTRIBUTES)
+    LC_LOCK();
+    lc_noutrefresh_marked(L, n);
+    lc_stat_begin(st, &sample);
+    doupdate();
+    lc_stat_end(st, LC_STAT_DOUPDATE, &sample);
+    LC_UNLOCK();
+    st->last_frame = now;
+    lc_resetmarked(L);
 
-    /* key functions */
-    CC(KEY_BREAK)       CC(KEY_DOWN)        CC(KEY_UP)
-    CC(KEY_LEFT)        CC(KEY_RIGHT)       CC(KEY_HOME)
-    CC(KEY_BACKSPACE)
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    CC(KEY_DL)          CC(KEY_IL)          CC(KEY_DC)
-    CC(KEY_IC)          CC(KEY_EIC)         CC(KEY_CLEAR)
-    CC(KEY_EOS)         CC(KEY_EOL)         CC(KEY_SF)
-    CC(KEY_SR)          CC(KEY_NPAGE)       CC(KEY_PPAGE)
-    CC(KEY_STAB)        CC(KEY_CTAB)        CC(KEY_CATAB)
-    CC(KEY_ENTER)       CC(KEY_SRESET)      CC(KEY_RESET)
-    CC(KEY_PRINT)       CC(KEY_LL)          CC(KEY_A1)
-    CC(KEY_A3)          CC(KEY_B2)          CC(KEY_C1)
-    CC(KEY_C3)          CC(KEY_BTAB)        CC(KEY_BEG)
-    CC(KEY_CANCEL)      CC(KEY_CLOSE)       CC(KEY_COMMAND)
-    CC(KEY_COPY)        CC(KEY_CREATE)      CC(KEY_END)
-    CC(KEY_EXIT)        CC(KEY_FIND)        CC(KEY_HELP)
-    CC(KEY_MARK)        CC(KEY_MESSAGE)     CC(KEY_MOUSE)
-    CC(KEY_MOVE)        CC(KEY_NEXT)        CC(KEY_OPEN)
-    CC(KEY_OPTIONS)     CC(KEY_PREVIOUS)    CC(KEY_REDO)
-    CC(KEY_REFERENCE)   CC(KEY_REFRESH)     CC(KEY_REPLACE)
-    CC(KEY_RESIZE)      CC(KEY_RESTART)     CC(KEY_RESUME)
-    CC(KEY_SAVE)        CC(KEY_SBEG)        CC(KEY_SCANCEL)
-    CC(KEY_SCOMMAND)    CC(KEY_SCOPY)       CC(KEY_SCREATE)
-    CC(KEY_SDC)         CC(KEY_SDL)         CC(KEY_SELECT)
-    CC(KEY_SEND)        CC(KEY_SEOL)        CC(KEY_SEXIT)
-    CC(KEY_SFIND)       CC(KEY_SHELP)       CC(KEY_SHOME)
-    CC(KEY_SIC)         CC(KEY_SLEFT)       CC(KEY_SMESSAGE)
-    CC(KEY_SMOVE)       CC(KEY_SNEXT)       CC(KEY_SOPTIONS)
-    CC(KEY_SPREVIOUS)   CC(KEY_SPRINT)      CC(KEY_SREDO)
-    CC(KEY_SREPLACE)    CC(KEY_SRIGHT)      CC(KEY_SRSUME)
-    CC(KEY_SSAVE)       CC(KEY_SSUSPEND)    CC(KEY_SUNDO)
-    CC(KEY_SUSPEND)     CC(KEY_UNDO)
-
-    /* KEY_Fx  0 <= x <= 63 */
-    CC(KEY_F0)              CC2(KEY_F1, KEY_F(1))   CC2(KEY_F2, KEY_F(2))
-    CC2(KEY_F3, KEY_F(3))   CC2(KEY_F4, KEY_F(4))   CC2(KEY_F5, KEY_F(5))
-    CC2(KEY_F6, KEY_F(6))   CC2(KEY_F7, KEY_F(7))   CC2(KEY_F8, KEY_F(8))
-    CC2(KEY_F9, KEY_F(9))   CC2(KEY_F10, KEY_F(10)) CC2(KEY_F11, KEY_F(11))
-    CC2(KEY_F12, KEY_F(12))
+/****f* curses/curses.max_fps
+ * FUNCTION
+ *   Limit curses.frame to fps frames a second while input is waiting,
+ *   or remove the limit if fps is 0; returns the previous limit.
+ *
+ * SYNOPSIS
+ *   curses.max_fps([fps])
+ ****/
+static int lc_max_fps(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+    int old = st->max_fps;
+    if (!lua_isnoneornil(L, 1))
+    {
+        st->max_fps = luaL_checkint(L, 1);
+        if (st->max_fps < 0) st->max_fps = 0;
+    }
+    lua_pushnumber(L, old);
+    return 1;
 }
 
 /*
-** make sure screen is restored (and cleared) at exit
-** (for the situations where program is aborted without a
-** proper cleanup)
+** =======================================================
+** render thread
+** =======================================================
 */
-static void cleanup(void)
+
+/*
+** curses.submit_frame copies the marked windows to curses' virtual
+** screen under curses_lock, and the render thread then writes the
+** difference to the terminal with doupdate, holding the lock, while
+** the Lua thread draws the next frame in its windows.  A frame that
+** arrives while the thread is still writing the last one is dropped:
+** its windows stay marked, and go out with the next frame.  The
+** thread writes a byte to render_pipe after each frame, so that
+** curses.wait can submit a dropped frame once the thread is free.
+**
+** Curses resizes every window of the screen in doupdate when it has
+** seen SIGWINCH, so while the thread runs lc_winch holds the signal
+** back, and the Lua thread passes it on and lets curses resize with
+** the lock held, in submit_frame, wait and the reads of keys.
+*/
+#ifdef HAVE_PTHREAD
+static pthread_t render_tid;
+static lc_state *render_owner;          /* the state that started it */
+static lc_state *render_for;            /* whose frame is pending */
+static int render_pending = 0, render_stopping = 0;
+static double render_frames = 0, render_dropped = 0;
+static int render_io_fd = -2;
+
+static void *lc_render_main(void *arg)
+{
+    sigset_t all;
+    char c = 0;
+
+    (void) arg;
+    /* signals, such as SIGWINCH, are for the Lua thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&curses_lock);
+    for (;;)
+    {
+        lc_sample sample;
+
+        while (!render_pending && !render_stopping)
+            pthread_cond_wait(&render_cond, &curses_lock);
+        /* write the last frame before stopping */
+        if (!render_pending)
+            break;
+        render_pending = 0;
+        if (!isendwin())
+        {
+            lc_stat_begin_fd(&sample, &render_io_fd);
+            doupdate();
+            if (render_for != NULL)
+                lc_stat_end(render_for, LC_STAT_DOUPDATE, &sample);
+            render_frames++;
+        }
+        if (write(render_pipe[1], &c, 1) < 0) {}
+    }
+    if (render_io_fd >= 0)
+        close(render_io_fd);
+    render_io_fd = -2;
+    pthread_mutex_unlock(&curses_lock);
+    return NULL;
+}
+
+static int lc_render_start(lc_state *st)
 {
+    int err;
+
+    if (!lc_winch_install())
+        return errno != 0 ? errno : EINVAL;
+    /* a resize curses has already seen is applied here, not there */
     if (!isendwin())
+        doupdate();
+
+    if (pipe(render_pipe) != 0)
+        return errno;
+    fcntl(render_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(render_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(render_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(render_pipe[1], F_SETFD, FD_CLOEXEC);
+
+    render_pending = render_stopping = render_deferred = 0;
+    render_owner = st;
+    render_for = NULL;
+    err = pthread_create(&render_tid, NULL, lc_render_main, NULL);
+    if (err != 0)
     {
-        wclear(stdscr);
-        wrefresh(stdscr);
-        endwin();
+        close(render_pipe[0]);
+        close(render_pipe[1]);
+        render_pipe[0] = render_pipe[1] = -1;
+        return err;
     }
+    render_running = 1;
+    return 0;
 }
 
-static int lc_initscr(lua_State *L)
+static void lc_render_stop(void)
 {
-    WINDOW *w;
+    int depth, i;
 
-    /* initialize curses */
-    w = initscr();
+    /* once we hold the lock, any holds lc_wrapped counts are ours */
+    pthread_mutex_lock(&curses_lock);
+    if (!render_running)
+    {
+        pthread_mutex_unlock(&curses_lock);
+        return;
+    }
 
-    /* no longer used, so clean it up */
-    lua_pushstring(L, RIPOFF_TABLE);
+    /* the thread, and any other caller stopping it, need the lock, so
+       let go of the holds of the wrapped functions we were called from
+       until it has stopped */
+    depth = lock_depth;
+    lock_depth = 0;
+    for (i = 0; i < depth; i++)
+        pthread_mutex_unlock(&curses_lock);
+
+    if (render_stopping)
+    {
+        /* another caller is joining it */
+        while (render_running)
+            pthread_cond_wait(&render_cond, &curses_lock);
+    }
+    else
+    {
+        render_stopping = 1;
+        pthread_cond_broadcast(&render_cond);
+        pthread_mutex_unlock(&curses_lock);
+        pthread_join(render_tid, NULL);
+        pthread_mutex_lock(&curses_lock);
+
+        close(render_pipe[0]);
+        close(render_pipe[1]);
+        render_pipe[0] = render_pipe[1] = -1;
+
+        /* curses applies it itself from now on */
+        if (winch_held)
+        {
+            winch_held = 0;
+            lc_winch_pass(SIGWINCH, NULL, NULL);
+        }
+        render_running = 0;
+        pthread_cond_broadcast(&render_cond);
+    }
+    pthread_mutex_unlock(&curses_lock);
+
+    for (i = 0; i < depth; i++)
+        pthread_mutex_lock(&curses_lock);
+    if (depth > 0)
+        lock_depth = depth;
+}
+
+/* pass on a resize held back while the thread runs, and let curses
+   apply it here, with the lock held */
+static void lc_render_winch(void)
+{
+    if (!winch_held)
+        return;
+
+    pthread_mutex_lock(&curses_lock);
+    winch_held = 0;
+    lc_winch_pass(SIGWINCH, NULL, NULL);
+    if (!isendwin())
+        doupdate();
+    pthread_mutex_unlock(&curses_lock);
+}
+
+/*
+** hand the marked windows to the thread; returns whether they went,
+** or were dropped because the thread is busy
+*/
+static int lc_render_submit(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+    int n;
+
+    lc_render_winch();
+    lc_getmarked(L);
+    n = lua_objlen(L, -1);
+    if (n == 0)
+    {
+        lua_pop(L, 1);
+        return 0;
+    }
+    if (pthread_mutex_trylock(&curses_lock) != 0)
+    {
+        render_dropped++;
+        render_deferred = 1;
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    /* a frame the thread has not started on is replaced */
+    if (render_pending)
+        render_dropped++;
+    lc_noutrefresh_marked(L, n);
+    render_pending = 1;
+    render_for = st;
+    render_deferred = 0;
+    /* callers of lc_render_stop may wait on it too */
+    pthread_cond_broadcast(&render_cond);
+    pthread_mutex_unlock(&curses_lock);
+
+    lua_pop(L, 1);
+    lc_resetmarked(L);
+    return 1;
+}
+#endif
+
+/****f* curses/curses.render_thread
+ * FUNCTION
+ *   Start the render thread if on is true, or stop it, after it has
+ *   written any frame it has been given, if on is false.  Returns
+ *   whether the thread was running, and the numbers of frames it has
+ *   written and dropped.
+ *
+ *   While the thread runs, curses.submit_frame hands it frames to
+ *   write.  Drawing in windows does not wait for it, but calls that
+ *   use the screen or write to the terminal, such as refresh,
+ *   doupdate, beep, curs_set, keypad, meta and init_pair, wait until
+ *   it has written the frame in hand.  curscr must not be read while
+ *   the thread runs.  getch and the other reads wait for a key
+ *   without holding up the thread.  endwin, newterm, set_term and
+ *   delscreen stop it.
+ *
+ *   The thread never resizes the windows: a terminal resize is
+ *   applied, and KEY_RESIZE queued, by the next submit_frame, wait,
+ *   getch or other read of keys.
+ *
+ *   Each frame's doupdate is counted in curses.stats of the Lua state
+ *   that submitted it.  Closing the Lua state that started the thread
+ *   stops it.
+ *
+ *   Threads are not supported on every system.
+ *
+ * SYNOPSIS
+ *   curses.render_thread([on])
+ *
+ * SEE ALSO
+ *   curses.submit_frame
+ ****/
+static int lc_render_thread(lua_State *L)
+{
+#ifdef HAVE_PTHREAD
+    int was = render_running;
+
+    if (!lua_isnoneornil(L, 1))
+    {
+        if (!lua_toboolean(L, 1))
+            lc_render_stop();
+        else if (!render_running)
+        {
+            int err;
+            if (stdscr == NULL)
+                return luaL_error(L, "curses is not initialized (call initscr first)");
+            if ((err = lc_render_start(lc_getstate(L))) != 0)
+                return luaL_error(L, "render_thread: %s", strerror(err));
+        }
+    }
+    lua_pushboolean(L, was);
+    LC_LOCK();
+    lua_pushnumber(L, render_frames);
+    LC_UNLOCK();
+    lua_pushnumber(L, render_dropped);
+    return 3;
+#else
+    if (lua_toboolean(L, 1))
+        return luaL_error(L, "render_thread: threads are not supported");
+    lua_pushboolean(L, 0);
+    lua_pushnumber(L, 0);
+    lua_pushnumber(L, 0);
+    return 3;
+#endif
+}
+
+/****f* curses/curses.submit_frame
+ * FUNCTION
+ *   Hand the windows marked with window:mark to the render thread, to
+ *   be written to the terminal while the caller goes on drawing;
+ *   returns true, or false if there was nothing to write, or the
+ *   thread was still writing the last frame, in which case the
+ *   windows stay marked for the next one.
+ *
+ *   Without the render thread, this is curses.frame(true).
+ *
+ * SEE ALSO
+ *   curses.render_thread, curses.frame, window:mark
+ ****/
+static int lc_submit_frame(lua_State *L)
+{
+#ifdef HAVE_PTHREAD
+    if (render_running)
+    {
+        lua_pushboolean(L, lc_render_submit(L));
+        return 1;
+    }
+#endif
+    lua_settop(L, 0);
+    lua_pushboolean(L, 1);
+    return lc_frame(L);
+}
+
+/*
+** =======================================================
+** profiling
+** =======================================================
+*/
+
+/****f* curses/curses.profile
+ * FUNCTION
+ *   Return a table mapping the name of each function called so far,
+ *   such as "curses.doupdate" or "window:addstr", to a table of its
+ *   calls and time (seconds), or nil if the module was loaded without
+ *   LCURSES_PROFILE set in the environment.
+ *
+ * SEE ALSO
+ *   curses.profile_reset
+ ****/
+static int lc_profile(lua_State *L)
+{
+    if (!lc_getstate(L)->profiling)
+        return 0;
+
+    lua_newtable(L);
+    lua_pushlightuserdata(L, (void *)&PROFILE_TABLE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
     lua_pushnil(L);
-    lua_settable(L, LUA_REGISTRYINDEX);
+    while (lua_next(L, -2))
+    {
+        lc_call_entry *e = lua_touserdata(L, -1);
+        if (e->calls > 0)
+        {
+            lua_pushvalue(L, -2);
+            lua_createtable(L, 0, 2);
+            lua_pushnumber(L, e->calls);
+            lua_setfield(L, -2, "calls");
+            lua_pushnumber(L, e->time);
+            lua_setfield(L, -2, "time");
+            lua_rawset(L, -6);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
 
-    /* failed to initialize */
-    if (w == NULL)
+/****f* curses/curses.profile_reset
+ * FUNCTION
+ *   Set the counts returned by curses.profile to zero.
+ ****/
+static int lc_profile_reset(lua_State *L)
+{
+    if (!lc_getstate(L)->profiling)
         return 0;
 
-    /* return stdscr - main window */
-    lcw_new(L, w);
+    lua_pushlightuserdata(L, (void *)&PROFILE_TABLE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+        lc_call_entry *e = lua_touserdata(L, -1);
+        e->calls = e->time = 0;
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+/*
+** =======================================================
+** tracing
+** =======================================================
+*/
+
+static void lc_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static void lc_put64(unsigned char *p, uint64_t v)
+{
+    lc_put32(p, (uint32_t)v);
+    lc_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+/****f* curses/curses.trace_dump
+ * FUNCTION
+ *   Write the calls in the trace ring, oldest first, to the file path,
+ *   returning true, or nil if the module was loaded without
+ *   LCURSES_TRACE set in the environment. The variable's value is the
+ *   size of the ring in calls, rounded up to a power of two, or 65536
+ *   if it is not a number.
+ *
+ *   The file is little-endian: the magic "LCTRACE1"; a 32-bit count of
+ *   functions, each a 32-bit id, 32-bit length and name; the 64-bit
+ *   count of calls traced and 32-bit count of calls that follow; then
+ *   40 bytes per call: 64-bit time in nanoseconds, 64-bit window
+ *   pointer, 32-bit function id and argument count, and the first four
+ *   arguments as 32-bit integers; for window methods, the window is
+ *   not counted among the arguments. trace_decode.lua reads it.
+ *
+ * EXAMPLE
+ *   curses.trace_dump("lcurses.trace")
+ ****/
+static int lc_trace_dump(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    lc_state *st = lc_getstate(L);
+    uint64_t i, n;
+    unsigned char buf[sizeof(lc_trace_record)];
+    FILE *f;
+
+    if (!st->tracing)
+        return 0;
+    n = st->trace_count < st->trace_size ? st->trace_count : st->trace_size;
 
-    /* save main window on registry */
-    lua_pushstring(L, STDSCR_REGISTRY);
-    lua_pushvalue(L, -2);
-    lua_rawset(L, LUA_REGISTRYINDEX);
+    f = fopen(path, "wb");
+    if (f == NULL)
+        return luaL_error(L, "trace_dump: %s: %s", path, strerror(errno));
 
-    /* setup curses constants - curses.xxx numbers */
-    register_curses_constants(L);
+    fwrite("LCTRACE1", 1, 8, f);
+    lc_put32(buf, st->call_ids);
+    fwrite(buf, 1, 4, f);
+    lua_pushlightuserdata(L, (void *)&PROFILE_TABLE);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+        const lc_call_entry *e = lua_touserdata(L, -1);
+        size_t len;
+        const char *name = lua_tolstring(L, -2, &len);
+
+        lc_put32(buf, e->id);
+        lc_put32(buf + 4, len);
+        fwrite(buf, 1, 8, f);
+        fwrite(name, 1, len, f);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
 
-    /* install cleanup handler to help in debugging and screen trashing */
-    atexit(cleanup);
+    lc_put64(buf, st->trace_count);
+    lc_put32(buf + 8, (uint32_t)n);
+    fwrite(buf, 1, 12, f);
+    for (i = st->trace_count - n; i < st->trace_count; i++)
+    {
+        const lc_trace_record *r = &st->trace_ring[i & (st->trace_size - 1)];
+        int j;
+
+        lc_put64(buf, r->time);
+        lc_put64(buf + 8, r->window);
+        lc_put32(buf + 16, r->id);
+        lc_put32(buf + 20, r->nargs);
+        for (j = 0; j < LC_TRACE_ARGS; j++)
+            lc_put32(buf + 24 + 4 * j, (uint32_t)r->arg[j]);
+        fwrite(buf, 1, 24 + 4 * LC_TRACE_ARGS, f);
+    }
 
+    if (ferror(f) | fclose(f))
+        return luaL_error(L, "trace_dump: %s: %s", path, strerror(errno));
+    lua_pushboolean(L, 1);
     return 1;
 }
 
@@ -509,16 +3720,39 @@ static int lc_initscr(lua_State *L)
 static int lc_endwin(lua_State *L)
 {
     (void) L;
+    lc_render_stop();
     endwin();
     return 0;
 }
 
 LC_BOOL(isendwin)
 
+/****f* curses/curses.curscr
+ * FUNCTION
+ *   Return curscr, the window holding the screen as curses believes
+ *   the terminal shows it, or nil if curses is not started.
+ *
+ *   While the render thread runs, it rewrites curscr with every frame,
+ *   so stop it with curses.render_thread(false) before reading curscr.
+ *
+ * SEE ALSO
+ *   curses.headless, curses.render_thread
+ ****/
+static int lc_curscr(lua_State *L)
+{
+    if (curscr == NULL)
+        lua_pushnil(L);
+    else
+        lcw_new(L, curscr);
+    return 1;
+}
+
 static int lc_stdscr(lua_State *L)
 {
-    lua_pushstring(L, STDSCR_REGISTRY);
-    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (stdscr == NULL)
+        lua_pushnil(L);
+    else
+        lcw_new(L, stdscr);
     return 1;
 }
 
@@ -531,7 +3765,7 @@ LC_NUMBER2(LINES, LINES)
 ** =======================================================
 */
 
-LC_BOOLOK(start_color)
+LC_LOCKED_BOOLOK(start_color)
 LC_BOOL(has_colors)
 
 static int lc_init_pair(lua_State *L)
@@ -540,7 +3774,12 @@ static int lc_init_pair(lua_State *L)
     short f = luaL_checkint(L, 2);
     short b = luaL_checkint(L, 3);
 
-    lua_pushboolean(L, B(init_pair(pair, f, b)));
+    int ret;
+
+    LC_LOCK();
+    ret = init_pair(pair, f, b);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
     return 1;
 }
 
@@ -604,12 +3843,20 @@ LC_STRING(longname)
 ** =======================================================
 */
 
-/* there is no easy way to implement this... */
-static lua_State *rip_L = NULL;
+/*
+** curses calls back without saying for whom, so the state starting a
+** screen leaves itself in rip_L (see lc_initscr) while curses calls
+** its callbacks
+*/
 static int ripoffline_cb(WINDOW* w, int cols)
 {
-    static int line = 0;
-    int top = lua_gettop(rip_L);
+    lc_state *st;
+    int top;
+
+    if (rip_L == NULL)
+        return 0;
+    st = lc_getstate(rip_L);
+    top = lua_gettop(rip_L);
 
     /* better be safe */
     if (!lua_checkstack(rip_L, 5))
@@ -625,7 +3872,7 @@ static int ripoffline_cb(WINDOW* w, int cols)
         return 0;
     }
 
-    lua_rawgeti(rip_L, -1, ++line); /* function to be called */
+    lua_rawgeti(rip_L, -1, ++st->ripped); /* function to be called */
     lcw_new(rip_L, w);              /* create window object */
     lua_pushnumber(rip_L, cols);    /* push number of columns */
 
@@ -637,7 +3884,7 @@ static int ripoffline_cb(WINDOW* w, int cols)
 
 static int lc_ripoffline(lua_State *L)
 {
-    static int rip = 0;
+    lc_state *st = lc_getstate(L);
     int top_line = lua_toboolean(L, 1);
 
     if (!lua_isfunction(L, 2))
@@ -646,9 +3893,6 @@ static int lc_ripoffline(lua_State *L)
         lua_error(L);
     }
 
-    /* need to save the lua state somewhere... */
-    rip_L = L;
-
     /* get the table where we are going to save the callbacks */
     lua_pushstring(L, RIPOFF_TABLE);
     lua_gettable(L, LUA_REGISTRYINDEX);
@@ -665,7 +3909,7 @@ static int lc_ripoffline(lua_State *L)
 
     /* save function callback in registry table */
     lua_pushvalue(L, 2);
-    lua_rawseti(L, -2, ++rip);
+    lua_rawseti(L, -2, ++st->rips);
 
     /* and tell curses we are going to take the line */
     lua_pushboolean(L, B(ripoffline(top_line ? 1 : -1, ripoffline_cb)));
@@ -675,7 +3919,11 @@ static int lc_ripoffline(lua_State *L)
 static int lc_curs_set(lua_State *L)
 {
     int vis = luaL_checkint(L, 1);
-    int state = curs_set(vis);
+    int state;
+
+    LC_LOCK();
+    state = curs_set(vis);
+    LC_UNLOCK();
     if (state == ERR)
         return 0;
 
@@ -695,8 +3943,8 @@ static int lc_napms(lua_State *L)
 ** beep
 ** =======================================================
 */
-LC_BOOLOK(beep)
-LC_BOOLOK(flash)
+LC_LOCKED_BOOLOK(beep)
+LC_LOCKED_BOOLOK(flash)
 
 
 /*
@@ -719,9 +3967,23 @@ static int lc_newwin(lua_State *L)
 static int lcw_delwin(lua_State *L)
 {
     WINDOW **w = lcw_get(L, 1);
-    if (*w != NULL && *w != stdscr)
+    if (*w != NULL && !lcw_isroot(L, *w))
     {
+        /* forget the pointer, which curses may hand out again */
+        lcw_getcache(L);
+        lua_pushlightuserdata(L, *w);
+        lua_rawget(L, -2);
+        if (lua_rawequal(L, -1, 1))
+        {
+            lua_pushlightuserdata(L, *w);
+            lua_pushnil(L);
+            lua_rawset(L, -4);
+        }
+        lua_pop(L, 2);
+
+        LC_LOCK();
         delwin(*w);
+        LC_UNLOCK();
         *w = NULL;
     }
     return 0;
@@ -810,8 +4072,23 @@ static int lcw_wsyncdown(lua_State *L)
 ** refresh
 ** =======================================================
 */
-LCW_BOOLOK(wrefresh)
-LCW_BOOLOK(wnoutrefresh)
+static int lcw_wrefresh(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    lc_state *st = lc_getstate(L);
+    lc_sample sample;
+    int ret;
+
+    LC_LOCK();
+    lc_stat_begin(st, &sample);
+    ret = wrefresh(w);
+    lc_stat_end(st, LC_STAT_WREFRESH, &sample);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
+    return 1;
+}
+
+LCW_LOCKED_BOOLOK(wnoutrefresh)
 LCW_BOOLOK(redrawwin)
 
 static int lcw_wredrawln(lua_State *L)
@@ -823,7 +4100,20 @@ static int lcw_wredrawln(lua_State *L)
     return 1;
 }
 
-LC_BOOLOK(doupdate)
+static int lc_doupdate(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+    lc_sample sample;
+    int ret;
+
+    LC_LOCK();
+    lc_stat_begin(st, &sample);
+    ret = doupdate();
+    lc_stat_end(st, LC_STAT_DOUPDATE, &sample);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
+    return 1;
+}
 
 /*
 ** =======================================================
@@ -905,6 +4195,103 @@ static int lcw_is_wintouched(lua_State *L)
     return 1;
 }
 
+/****m* window/touched_lines
+ * FUNCTION
+ *   Return the lines of the window changed since it was last
+ *   refreshed, as a list of line numbers, or with ranges true, as a
+ *   list of {first, last} pairs of adjacent changed lines.
+ *
+ * SYNOPSIS
+ *   win:touched_lines([ranges])
+ *
+ * SEE ALSO
+ *   window:touched_span, window:is_linetouched
+ ****/
+static int lcw_touched_lines(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    int ranges = lua_toboolean(L, 2);
+    int nlines = getmaxy(w), y, n = 0;
+
+    lua_newtable(L);
+    for (y = 0; y < nlines; y++)
+    {
+        int first = y;
+
+        if (!is_linetouched(w, y))
+            continue;
+        if (!ranges)
+        {
+            lua_pushnumber(L, y);
+            lua_rawseti(L, -2, ++n);
+            continue;
+        }
+        while (y + 1 < nlines && is_linetouched(w, y + 1))
+            y++;
+        lua_createtable(L, 2, 0);
+        lua_pushnumber(L, first);
+        lua_rawseti(L, -2, 1);
+        lua_pushnumber(L, y);
+        lua_rawseti(L, -2, 2);
+        lua_rawseti(L, -2, ++n);
+    }
+    return 1;
+}
+
+/*
+** ncurses' private struct ldat, one per line of a window.  w->_line is
+** an array of them, so the whole layout is relied on, not just the
+** fields read: these four fields, from ncurses 1.9 to 6.  Other
+** versions, and builds that hide WINDOW, get the whole line.
+*/
+#if defined(NCURSES_VERSION) && !NCURSES_OPAQUE \
+    && defined(NCURSES_VERSION_MAJOR) && NCURSES_VERSION_MAJOR <= 6
+#define LC_LDAT 1
+struct lc_ldat
+{
+    void *text;
+    NCURSES_SIZE_T firstchar;
+    NCURSES_SIZE_T lastchar;
+    NCURSES_SIZE_T oldindex;
+};
+#endif
+
+/****m* window/touched_span
+ * FUNCTION
+ *   Return the first and last columns changed on line y since the
+ *   window was last refreshed, or nothing if the line is unchanged.
+ *   Where curses does not expose the columns, the whole line is
+ *   returned.
+ *
+ * SYNOPSIS
+ *   first, last = win:touched_span(y)
+ ****/
+static int lcw_touched_span(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    int y = luaL_checkint(L, 2);
+    int first = 0, last = getmaxx(w) - 1;
+
+    if (y < 0 || y >= getmaxy(w) || !is_linetouched(w, y))
+        return 0;
+
+#ifdef LC_LDAT
+    {
+        struct lc_ldat *line = (struct lc_ldat *)w->_line + y;
+        if (line->firstchar >= 0 && line->lastchar >= line->firstchar
+            && line->lastchar <= last)
+        {
+            first = line->firstchar;
+            last = line->lastchar;
+        }
+    }
+#endif
+
+    lua_pushnumber(L, first);
+    lua_pushnumber(L, last);
+    return 2;
+}
+
 /*
 ** =======================================================
 ** getyx
@@ -1061,8 +4448,8 @@ static int lc_slk_set(lua_State *L)
     return 1;
 }
 
-LC_BOOLOK(slk_refresh)
-LC_BOOLOK(slk_noutrefresh)
+LC_LOCKED_BOOLOK(slk_refresh)
+LC_LOCKED_BOOLOK(slk_noutrefresh)
 
 static int lc_slk_label(lua_State *L)
 {
@@ -1072,7 +4459,7 @@ static int lc_slk_label(lua_State *L)
 }
 
 LC_BOOLOK(slk_clear)
-LC_BOOLOK(slk_restore)
+LC_LOCKED_BOOLOK(slk_restore)
 LC_BOOLOK(slk_touch)
 
 static int lc_slk_attron(lua_State *L)
@@ -1126,7 +4513,12 @@ static int lcw_wechochar(lua_State *L)
     WINDOW *w = lcw_check(L, 1);
     chtype ch = lc_checkch(L, 2);
 
-    lua_pushboolean(L, B(wechochar(w, ch)));
+    int ret;
+
+    LC_LOCK();
+    ret = wechochar(w, ch);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
     return 1;
 }
 
@@ -1196,6 +4588,81 @@ static int lcw_mvwaddnstr(lua_State *L)
     return 1;
 }
 
+#ifdef HAVE_NCURSESW
+/****m* window/addwstr
+ * FUNCTION
+ *   Write a UTF-8 string, or its first n characters, to the window.
+ *
+ * SYNOPSIS
+ *   win:addwstr(str [, n])
+ ****/
+static int lcw_waddnwstr(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    wchar_t buf[LC_WBUF];
+    size_t len;
+    wchar_t *wstr = lc_checkwstr(L, 2, buf, &len);
+    int n = luaL_optint(L, 3, -1);
+
+    if (n < 0 || n > (int) len) n = len;
+
+    lua_pushboolean(L, B(waddnwstr(w, wstr, n)));
+    return 1;
+}
+
+static int lcw_mvwaddnwstr(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    int y = luaL_checkint(L, 2);
+    int x = luaL_checkint(L, 3);
+    wchar_t buf[LC_WBUF];
+    size_t len;
+    wchar_t *wstr = lc_checkwstr(L, 4, buf, &len);
+    int n = luaL_optint(L, 5, -1);
+
+    if (n < 0 || n > (int) len) n = len;
+
+    lua_pushboolean(L, B(mvwaddnwstr(w, y, x, wstr, n)));
+    return 1;
+}
+
+/****m* window/add_wchstr
+ * FUNCTION
+ *   Copy a wchstr, or its first n cells, to the window, as addchstr
+ *   does for a chstr.
+ *
+ * SYNOPSIS
+ *   win:add_wchstr(wchstr [, n])
+ ****/
+static int lcw_wadd_wchnstr(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    wchstr *ws = lc_checkwchstr(L, 2);
+    int n = luaL_optint(L, 3, -1);
+
+    if (n < 0 || n > (int) ws->len)
+        n = ws->len;
+
+    lua_pushboolean(L, B(wadd_wchnstr(w, ws->str, n)));
+    return 1;
+}
+
+static int lcw_mvwadd_wchnstr(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    int y = luaL_checkint(L, 2);
+    int x = luaL_checkint(L, 3);
+    wchstr *ws = lc_checkwchstr(L, 4);
+    int n = luaL_optint(L, 5, -1);
+
+    if (n < 0 || n > (int) ws->len)
+        n = ws->len;
+
+    lua_pushboolean(L, B(mvwadd_wchnstr(w, y, x, ws->str, n)));
+    return 1;
+}
+#endif
+
 /*
 ** =======================================================
 ** bkgd
@@ -1273,11 +4740,17 @@ static int lcw_intrflush(lua_State *L)
     return 1;
 }
 
+/* keypad and meta write to the terminal at once */
 static int lcw_keypad(lua_State *L)
 {
     WINDOW *w = lcw_check(L, 1);
     int bf = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
-    lua_pushboolean(L, B(keypad(w, bf)));
+    int ret;
+
+    LC_LOCK();
+    ret = keypad(w, bf);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
     return 1;
 }
 
@@ -1285,7 +4758,12 @@ static int lcw_meta(lua_State *L)
 {
     WINDOW *w = lcw_check(L, 1);
     int bf = lua_toboolean(L, 2);
-    lua_pushboolean(L, B(meta(w, bf)));
+    int ret;
+
+    LC_LOCK();
+    ret = meta(w, bf);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
     return 1;
 }
 
@@ -1427,6 +4905,41 @@ static int lcw_copywin(lua_State *L)
     return 1;
 }
 
+/****m* window/blit
+ * FUNCTION
+ *   Copy the h x w rectangle at (sy, sx) of a grid to (dy, dx) in the
+ *   window, clipped to both.  h and w default to the whole grid.  The
+ *   cursor is not moved.
+ *
+ * SYNOPSIS
+ *   window:blit(grid, sy, sx, dy, dx [, h, w])
+ ****/
+static int lcw_blit(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    grid *g = lc_checkgrid(L, 2);
+    int sy = luaL_checkint(L, 3);
+    int sx = luaL_checkint(L, 4);
+    int dy = luaL_checkint(L, 5);
+    int dx = luaL_checkint(L, 6);
+    int h = luaL_optint(L, 7, g->rows);
+    int wd = luaL_optint(L, 8, g->cols);
+    int y, x, rows, cols, i, ok = TRUE;
+
+    getyx(w, y, x);
+    getmaxyx(w, rows, cols);
+    if (lc_clip_rect(&sy, &sx, &dy, &dx, &h, &wd, g->rows, g->cols, rows, cols))
+    {
+        for (i = 0; i < h; ++i)
+            if (mvwaddchnstr(w, dy + i, dx, GRID_CELL(g, sy + i, sx), wd) == ERR)
+                ok = FALSE;
+        wmove(w, y, x);
+    }
+
+    lua_pushboolean(L, ok);
+    return 1;
+}
+
 /*
 ** =======================================================
 ** util
@@ -1450,7 +4963,12 @@ static int lc_keyname(lua_State *L)
 static int lc_delay_output(lua_State *L)
 {
     int ms = luaL_checkint(L, 1);
-    lua_pushboolean(L, B(delay_output(ms)));
+    int ret;
+
+    LC_LOCK();
+    ret = delay_output(ms);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
     return 1;
 }
 
@@ -1501,13 +5019,119 @@ static int lcw_winsdelln(lua_State *L)
 ** =======================================================
 */
 
+/*
+** Keys are read with the lock held, but while the render thread runs
+** or other states share curses, a read that would block must not keep
+** them waiting for a key.  lc_read then tries the read without
+** blocking, and while there is nothing, waits for input with the lock
+** let go.
+*/
+typedef int (*lc_reader)(WINDOW *w, void *arg);
+
+static int lc_read_getch(WINDOW *w, void *arg)
+{
+    (void) arg;
+    return wgetch(w);
+}
+
+#ifdef HAVE_NCURSESW
+static int lc_read_get_wch(WINDOW *w, void *arg)
+{
+    return wget_wch(w, (wint_t *)arg);
+}
+#endif
+
+/* the functions that wait are not wrapped in the lock (see lc_waiting),
+   so take it to move */
+static int lc_wmove(WINDOW *w, int y, int x)
+{
+    int ret;
+
+    LC_LOCK();
+    ret = wmove(w, y, x);
+    LC_UNLOCK();
+    return ret;
+}
+
+/* read from w with f; returns what f did, with the lock held */
+static int lc_read(lua_State *L, WINDOW *w, lc_reader f, void *arg)
+{
+#ifdef HAVE_PTHREAD
+    int delay = -1;
+
+    /* without wgetdelay, assume the default of blocking */
+#ifdef NCURSES_EXT_FUNCS
+    delay = wgetdelay(w);
+#endif
+    if ((locking || render_running) && delay != 0)
+    {
+        struct pollfd p;
+        double deadline = lc_now() + delay / 1000.0;
+        int r, ms = -1;
+
+        p.fd = lc_inputfd(L);
+        p.events = POLLIN;
+        for (;;)
+        {
+            lc_render_winch();
+            LC_LOCK();
+            wtimeout(w, 0);
+            r = f(w, arg);
+            wtimeout(w, delay);
+            if (r != ERR
+                || (delay > 0 && (ms = (int)((deadline - lc_now()) * 1000)) <= 0))
+                return r;
+            LC_UNLOCK();
+
+            /* a signal, such as SIGWINCH, ends the wait too */
+            p.revents = 0;
+            poll(&p, 1, ms);
+        }
+    }
+#else
+    (void) L;
+#endif
+    LC_LOCK();
+    return f(w, arg);
+}
+
+/* wait without the lock until a line read from w need not wait for its
+   first key, then take the lock */
+static void lc_read_line(lua_State *L, WINDOW *w)
+{
+#ifdef HAVE_PTHREAD
+    int delay = -1;
+
+#ifdef NCURSES_EXT_FUNCS
+    delay = wgetdelay(w);
+#endif
+    if ((locking || render_running) && delay != 0)
+    {
+        struct pollfd p;
+
+        lc_render_winch();
+        p.fd = lc_inputfd(L);
+        p.events = POLLIN;
+        p.revents = 0;
+        poll(&p, 1, delay);
+    }
+#else
+    (void) L;
+    (void) w;
+#endif
+    LC_LOCK();
+}
+
 static int lcw_wgetch(lua_State *L)
 {
     WINDOW *w = lcw_check(L, 1);
-    int c = wgetch(w);
+    int c;
 
+    c = lc_read(L, w, lc_read_getch, NULL);
+    LC_UNLOCK();
     if (c == ERR) return 0;
 
+    lc_keypressed(lc_getstate(L));
     lua_pushnumber(L, c);
     return 1;
 }
@@ -1519,16 +5143,212 @@ static int lcw_mvwgetch(lua_State *L)
     int x = luaL_checkint(L, 3);
     int c;
 
-    if (wmove(w, y, x) == ERR) return 0;
-
-    c = wgetch(w);
+    if (lc_wmove(w, y, x) == ERR) return 0;
 
+    c = lc_read(L, w, lc_read_getch, NULL);
+    LC_UNLOCK();
     if (c == ERR) return 0;
 
+    lc_keypressed(lc_getstate(L));
     lua_pushnumber(L, c);
     return 1;
 }
 
+/****m* window/getch_batch
+ * FUNCTION
+ *   Wait for a key as getch does, then read every key that is already
+ *   queued, up to max (default 1024); returns them as a list of key
+ *   codes, or nil if there were none.
+ *
+ *   With as_string true, the keys are returned as a string of bytes
+ *   instead; reading stops at the first key that is not a byte, which
+ *   is returned as a second value, so the string is empty if that key
+ *   came first.  Nothing is pushed back, so curses.wait sees no key
+ *   left waiting.
+ *
+ * SYNOPSIS
+ *   win:getch_batch([max [, as_string]])
+ *
+ * SEE ALSO
+ *   window:getch, curses.ungetch
+ ****/
+static int lcw_wgetch_batch(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    int max = luaL_optint(L, 2, 1024);
+    int as_string = lua_toboolean(L, 3);
+    int delay = -1, n, c, key = ERR;
+    luaL_Buffer b;
+
+    /* without wgetdelay, assume the default of blocking */
+#ifdef NCURSES_EXT_FUNCS
+    delay = wgetdelay(w);
+#endif
+
+    if (max < 1)
+        return 0;
+    if ((c = lc_read(L, w, lc_read_getch, NULL)) == ERR)
+    {
+        LC_UNLOCK();
+        return 0;
+    }
+    lc_keypressed(lc_getstate(L));
+
+    if (as_string)
+        luaL_buffinit(L, &b);
+    else
+        lua_createtable(L, max < 64 ? max : 64, 0);
+
+    /* the rest of the burst is already queued, so do not wait for it */
+    wtimeout(w, 0);
+    for (n = 0; n < max; n++)
+    {
+        if (n > 0 && (c = wgetch(w)) == ERR)
+            break;
+        if (as_string)
+        {
+            if (c > 255)
+            {
+                key = c;
+                break;
+            }
+            luaL_addchar(&b, (char)c);
+        }
+        else
+        {
+            lua_pushnumber(L, c);
+            lua_rawseti(L, -2, n + 1);
+        }
+    }
+    wtimeout(w, delay);
+    LC_UNLOCK();
+
+    if (!as_string)
+        return 1;
+    luaL_pushresult(&b);
+    if (key == ERR)
+        return 1;
+    lua_pushnumber(L, key);
+    return 2;
+}
+
+#ifdef HAVE_NCURSESW
+/****m* window/get_wch
+ * FUNCTION
+ *   Read a character, which is returned as a UTF-8 string, or a
+ *   function key, which is returned as its KEY_ code.
+ *
+ *   Multibyte input is decoded by curses according to the locale,
+ *   which must be set first, e.g. with os.setlocale("").
+ *
+ * SYNOPSIS
+ *   win:get_wch()
+ *
+ * SEE ALSO
+ *   window:getch, window:get_wch_batch, get_wch(3)
+ ****/
+static int lcw_wget_wch(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    wint_t c;
+    int r;
+
+    r = lc_read(L, w, lc_read_get_wch, &c);
+    LC_UNLOCK();
+    switch (r)
+    {
+    case OK:
+        lc_keypressed(lc_getstate(L));
+        lc_utf8_pushchar(L, c);
+        return 1;
+    case KEY_CODE_YES:
+        lc_keypressed(lc_getstate(L));
+        lua_pushnumber(L, c);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/****m* window/get_wch_batch
+ * FUNCTION
+ *   Like getch_batch, but for characters: waits for one as get_wch
+ *   does, then reads every character already queued, up to max
+ *   (default 1024), decoding them all in one pass.  Returns a list of
+ *   UTF-8 strings and KEY_ codes, or nil if nothing was read.
+ *
+ *   With as_string true, the characters are returned as one UTF-8
+ *   string instead; reading stops at the first function key, which is
+ *   returned as a second value, as getch_batch does.
+ *
+ * SYNOPSIS
+ *   win:get_wch_batch([max [, as_string]])
+ ****/
+static int lcw_wget_wch_batch(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    int max = luaL_optint(L, 2, 1024);
+    int as_string = lua_toboolean(L, 3);
+    int delay = -1, n, r, key = ERR;
+    wint_t c;
+    luaL_Buffer b;
+
+    /* without wgetdelay, assume the default of blocking */
+#ifdef NCURSES_EXT_FUNCS
+    delay = wgetdelay(w);
+#endif
+
+    if (max < 1)
+        return 0;
+    if ((r = lc_read(L, w, lc_read_get_wch, &c)) == ERR)
+    {
+        LC_UNLOCK();
+        return 0;
+    }
+    lc_keypressed(lc_getstate(L));
+
+    if (as_string)
+        luaL_buffinit(L, &b);
+    else
+        lua_createtable(L, max < 64 ? max : 64, 0);
+
+    /* the rest of the burst is already queued, so do not wait for it */
+    wtimeout(w, 0);
+    for (n = 0; n < max; n++)
+    {
+        if (n > 0 && (r = wget_wch(w, &c)) == ERR)
+            break;
+        if (as_string)
+        {
+            if (r == KEY_CODE_YES)
+            {
+                key = c;
+                break;
+            }
+            lc_utf8_addchar(&b, c);
+        }
+        else
+        {
+            if (r == KEY_CODE_YES)
+                lua_pushnumber(L, c);
+            else
+                lc_utf8_pushchar(L, c);
+            lua_rawseti(L, -2, n + 1);
+        }
+    }
+    wtimeout(w, delay);
+    LC_UNLOCK();
+
+    if (!as_string)
+        return 1;
+    luaL_pushresult(&b);
+    if (key == ERR)
+        return 1;
+    lua_pushnumber(L, key);
+    return 2;
+}
+#endif
+
 static int lc_ungetch(lua_State *L)
 {
     int c = luaL_checkint(L, 1);
@@ -1547,14 +5367,50 @@ static int lcw_wgetnstr(lua_State *L)
     WINDOW *w = lcw_check(L, 1);
     int n = luaL_optint(L, 2, 0);
     char buf[LUAL_BUFFERSIZE];
+    int ret;
 
     if (n == 0 || n >= LUAL_BUFFERSIZE) n = LUAL_BUFFERSIZE - 1;
-    if (wgetnstr(w, buf, n) == ERR)
+    lc_read_line(L, w);
+    ret = wgetnstr(w, buf, n);
+    LC_UNLOCK();
+    if (ret == ERR)
+        return 0;
+
+    lua_pushstring(L, buf);
+    return 1;
+}
+
+#ifdef HAVE_NCURSESW
+/****m* window/get_wstr
+ * FUNCTION
+ *   Read a line of at most n characters, like getstr, and return it
+ *   as a UTF-8 string.
+ *
+ * SYNOPSIS
+ *   win:get_wstr([n])
+ ****/
+static int lcw_wgetn_wstr(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    int n = luaL_optint(L, 2, 0);
+    wint_t buf[LUAL_BUFFERSIZE];
+    luaL_Buffer b;
+    int i, ret;
+
+    if (n <= 0 || n >= LUAL_BUFFERSIZE) n = LUAL_BUFFERSIZE - 1;
+    lc_read_line(L, w);
+    ret = wgetn_wstr(w, buf, n);
+    LC_UNLOCK();
+    if (ret == ERR)
         return 0;
 
-    lua_pushstring(L, buf);
+    luaL_buffinit(L, &b);
+    for (i = 0; buf[i] != 0; i++)
+        lc_utf8_addchar(&b, buf[i]);
+    luaL_pushresult(&b);
     return 1;
 }
+#endif
 
 static int lcw_mvwgetnstr(lua_State *L)
 {
@@ -1563,9 +5419,14 @@ static int lcw_mvwgetnstr(lua_State *L)
     int x = luaL_checkint(L, 3);
     int n = luaL_optint(L, 4, -1);
     char buf[LUAL_BUFFERSIZE];
+    int ret;
 
     if (n == 0 || n >= LUAL_BUFFERSIZE) n = LUAL_BUFFERSIZE - 1;
-    if (mvwgetnstr(w, y, x, buf, n) == ERR)
+    if (lc_wmove(w, y, x) == ERR) return 0;
+    lc_read_line(L, w);
+    ret = wgetnstr(w, buf, n);
+    LC_UNLOCK();
+    if (ret == ERR)
         return 0;
 
     lua_pushstring(L, buf);
@@ -1626,6 +5487,112 @@ static int lcw_mvwinchnstr(lua_State *L)
     return 1;
 }
 
+/* read into an existing chstr; returns the number of cells read */
+static int lcw_winchnstr_into(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    chstr *cs = lc_checkchstr(L, 2);
+    int n = luaL_optint(L, 3, cs->len);
+    chtype next;
+    int r;
+
+    if (n < 0 || n > (int) cs->len)
+        n = cs->len;
+
+    /* winchnstr terminates the cells it reads, which in a view would
+       overwrite the next cell of the parent */
+    next = cs->str[n];
+    r = winchnstr(w, cs->str, n);
+    cs->str[n] = next;
+    if (r == ERR)
+        return 0;
+
+    lua_pushnumber(L, r);
+    return 1;
+}
+
+static int lcw_mvwinchnstr_into(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    chstr *cs = lc_checkchstr(L, 2);
+    int y = luaL_checkint(L, 3);
+    int x = luaL_checkint(L, 4);
+    int n = luaL_optint(L, 5, cs->len);
+    chtype next;
+    int r;
+
+    if (n < 0 || n > (int) cs->len)
+        n = cs->len;
+
+    next = cs->str[n];
+    r = mvwinchnstr(w, y, x, cs->str, n);
+    cs->str[n] = next;
+    if (r == ERR)
+        return 0;
+
+    lua_pushnumber(L, r);
+    return 1;
+}
+
+/*
+** read the whole window into a grid, or into a table of chstrs, one
+** per line; rows that are missing or too short are (re)allocated, so
+** passing the same table back on the next call allocates nothing
+*/
+static int lcw_winchstr_all(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    grid *g = lc_togrid(L, 2);
+    int y, x, rows, cols, i;
+
+    getyx(w, y, x);
+    getmaxyx(w, rows, cols);
+
+    if (g != NULL)
+    {
+        if (rows > g->rows) rows = g->rows;
+        if (cols > g->cols) cols = g->cols;
+        for (i = 0; i < rows; ++i)
+        {
+            chtype *line = GRID_CELL(g, i, 0);
+            chtype next = line[cols];
+            mvwinchnstr(w, i, 0, line, cols);
+            line[cols] = next;
+        }
+    }
+    else if (lua_isnoneornil(L, 2))
+    {
+        lua_settop(L, 1);
+        lua_createtable(L, rows, 0);
+    }
+    else
+        luaL_checktype(L, 2, LUA_TTABLE);
+
+    for (i = 0; g == NULL && i < rows; ++i)
+    {
+        chstr *cs;
+        chtype next;
+
+        lua_rawgeti(L, 2, i + 1);
+        cs = lc_tochstr(L, -1);
+        if (cs == NULL || (int) cs->len < cols)
+        {
+            lua_pop(L, 1);
+            cs = chstr_new(L, cols);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, 2, i + 1);
+        }
+        next = cs->str[cols];
+        mvwinchnstr(w, i, 0, cs->str, cols);
+        cs->str[cols] = next;
+        lua_pop(L, 1);
+    }
+
+    wmove(w, y, x);
+    lua_settop(L, 2);
+    return 1;
+}
+
 /*
 ** =======================================================
 ** instr
@@ -1730,6 +5697,46 @@ static int lcw_mvwinsnstr(lua_State *L)
     return 1;
 }
 
+#ifdef HAVE_NCURSESW
+/****m* window/ins_wstr
+ * FUNCTION
+ *   Insert a UTF-8 string, or its first n characters, before the
+ *   cursor.
+ *
+ * SYNOPSIS
+ *   win:ins_wstr(str [, n])
+ ****/
+static int lcw_wins_nwstr(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    wchar_t buf[LC_WBUF];
+    size_t len;
+    wchar_t *wstr = lc_checkwstr(L, 2, buf, &len);
+    int n = luaL_optint(L, 3, -1);
+
+    if (n < 0 || n > (int) len) n = len;
+
+    lua_pushboolean(L, B(wins_nwstr(w, wstr, n)));
+    return 1;
+}
+
+static int lcw_mvwins_nwstr(lua_State *L)
+{
+    WINDOW *w = lcw_check(L, 1);
+    int y = luaL_checkint(L, 2);
+    int x = luaL_checkint(L, 3);
+    wchar_t buf[LC_WBUF];
+    size_t len;
+    wchar_t *wstr = lc_checkwstr(L, 4, buf, &len);
+    int n = luaL_optint(L, 5, -1);
+
+    if (n < 0 || n > (int) len) n = len;
+
+    lua_pushboolean(L, B(mvwins_nwstr(w, y, x, wstr, n)));
+    return 1;
+}
+#endif
+
 /*
 ** =======================================================
 ** pad
@@ -1765,9 +5772,16 @@ static int lcw_prefresh(lua_State *L)
     int smincol = luaL_checkint(L, 5);
     int smaxrow = luaL_checkint(L, 6);
     int smaxcol = luaL_checkint(L, 7);
-
-    lua_pushboolean(L, B(prefresh(p, pminrow, pmincol,
-        sminrow, smincol, smaxrow, smaxcol)));
+    lc_state *st = lc_getstate(L);
+    lc_sample sample;
+    int ret;
+
+    LC_LOCK();
+    lc_stat_begin(st, &sample);
+    ret = prefresh(p, pminrow, pmincol, sminrow, smincol, smaxrow, smaxcol);
+    lc_stat_end(st, LC_STAT_PREFRESH, &sample);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
     return 1;
 }
 
@@ -1780,9 +5794,12 @@ static int lcw_pnoutrefresh(lua_State *L)
     int smincol = luaL_checkint(L, 5);
     int smaxrow = luaL_checkint(L, 6);
     int smaxcol = luaL_checkint(L, 7);
+    int ret;
 
-    lua_pushboolean(L, B(pnoutrefresh(p, pminrow, pmincol,
-        sminrow, smincol, smaxrow, smaxcol)));
+    LC_LOCK();
+    ret = pnoutrefresh(p, pminrow, pmincol, sminrow, smincol, smaxrow, smaxcol);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
     return 1;
 }
 
@@ -1792,7 +5809,12 @@ static int lcw_pechochar(lua_State *L)
     WINDOW *p = lcw_check(L, 1);
     chtype ch = lc_checkch(L, 2);
 
-    lua_pushboolean(L, B(pechochar(p, ch)));
+    int ret;
+
+    LC_LOCK();
+    ret = pechochar(p, ch);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
     return 1;
 }
 
@@ -1832,20 +5854,206 @@ LCW_BOOLOK(wstandout)
 
 /*
 ** =======================================================
-** query terminfo database
+** stdscr shortcuts
 ** =======================================================
 */
 
-static char ti_capname[32];
+/*
+** These detect the number of arguments, like the Unified Functions in
+** Perl Curses (see http://search.cpan.org/perldoc?Curses), and work
+** on stdscr directly rather than through its window object.
+*/
+static WINDOW *lc_checkstdscr(lua_State *L)
+{
+    if (stdscr == NULL)
+        luaL_error(L, "curses is not initialized (call initscr first)");
+    return stdscr;
+}
+
+#define LCS_BOOLOK(n, f)                    \
+    static int lc_ ## n(lua_State *L)       \
+    {                                       \
+        WINDOW *w = lc_checkstdscr(L);      \
+        lua_pushboolean(L, B(f(w)));        \
+        return 1;                           \
+    }
+
+LCS_BOOLOK(clear, wclear)
+LCS_BOOLOK(clrtobot, wclrtobot)
+LCS_BOOLOK(clrtoeol, wclrtoeol)
+
+static int lc_refresh(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+    lc_state *st = lc_getstate(L);
+    lc_sample sample;
+    int ret;
+
+    LC_LOCK();
+    lc_stat_begin(st, &sample);
+    ret = wrefresh(w);
+    lc_stat_end(st, LC_STAT_WREFRESH, &sample);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
+    return 1;
+}
+
+static int lc_addch(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+
+    if (lua_gettop(L) == 3)
+    {
+        int y = luaL_checkint(L, 1);
+        int x = luaL_checkint(L, 2);
+        chtype ch = lc_checkch(L, 3);
+        lua_pushboolean(L, B(mvwaddch(w, y, x, ch)));
+    }
+    else
+        lua_pushboolean(L, B(waddch(w, lc_checkch(L, 1))));
+    return 1;
+}
+
+static int lc_addstr(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+
+    if (lua_gettop(L) == 3)
+    {
+        int y = luaL_checkint(L, 1);
+        int x = luaL_checkint(L, 2);
+        const char *str = luaL_checkstring(L, 3);
+        lua_pushboolean(L, B(mvwaddnstr(w, y, x, str, lua_strlen(L, 3))));
+    }
+    else
+    {
+        const char *str = luaL_checkstring(L, 1);
+        int n = luaL_optint(L, 2, -1);
+
+        if (n < 0) n = lua_strlen(L, 1);
+        lua_pushboolean(L, B(waddnstr(w, str, n)));
+    }
+    return 1;
+}
+
+/* characters are returned as one-byte strings, and keys as numbers */
+static int lc_getch(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+    int c;
+
+    if (lua_gettop(L) == 2)
+    {
+        int y = luaL_checkint(L, 1);
+        int x = luaL_checkint(L, 2);
+        if (lc_wmove(w, y, x) == ERR) return 0;
+    }
+
+    c = lc_read(L, w, lc_read_getch, NULL);
+    LC_UNLOCK();
+    if (c == ERR) return 0;
+
+    lc_keypressed(lc_getstate(L));
+    if (c < 256)
+    {
+        char ch = (char)c;
+        lua_pushlstring(L, &ch, 1);
+    }
+    else
+        lua_pushnumber(L, c);
+    return 1;
+}
+
+static int lc_getstr(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+    char buf[LUAL_BUFFERSIZE];
+    int n, ret;
+
+    if (lua_gettop(L) > 1)
+    {
+        int y = luaL_checkint(L, 1);
+        int x = luaL_checkint(L, 2);
+        n = luaL_optint(L, 3, -1);
+        if (lc_wmove(w, y, x) == ERR) return 0;
+    }
+    else
+        n = luaL_optint(L, 1, 0);
+
+    if (n <= 0 || n >= LUAL_BUFFERSIZE) n = LUAL_BUFFERSIZE - 1;
+    lc_read_line(L, w);
+    ret = wgetnstr(w, buf, n);
+    LC_UNLOCK();
+    if (ret == ERR)
+        return 0;
+
+    lua_pushstring(L, buf);
+    return 1;
+}
+
+static int lc_attrset(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+    int attrs = luaL_checkint(L, 1);
+    lua_pushboolean(L, B(wattrset(w, attrs)));
+    return 1;
+}
+
+static int lc_getyx(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+    int y, x;
+    getyx(w, y, x);
+    lua_pushnumber(L, y);
+    lua_pushnumber(L, x);
+    return 2;
+}
+
+static int lc_keypad(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+    int bf = lua_isnoneornil(L, 1) ? 1 : lua_toboolean(L, 1);
+    int ret;
+
+    LC_LOCK();
+    ret = keypad(w, bf);
+    LC_UNLOCK();
+    lua_pushboolean(L, B(ret));
+    return 1;
+}
+
+static int lc_move(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+    int y = luaL_checkint(L, 1);
+    int x = luaL_checkint(L, 2);
+    lua_pushboolean(L, B(wmove(w, y, x)));
+    return 1;
+}
+
+static int lc_timeout(lua_State *L)
+{
+    WINDOW *w = lc_checkstdscr(L);
+    int delay = luaL_checkint(L, 1);
+    wtimeout(w, delay);
+    return 0;
+}
+
+/*
+** =======================================================
+** query terminfo database
+** =======================================================
+*/
 
 static int ti_getflag (lua_State *L)
 {
+    char capname[32];
     int res;
 
-    strlcpy (ti_capname, luaL_checkstring (L, 1), sizeof (ti_capname));
-    res = tigetflag (ti_capname);
+    strlcpy (capname, luaL_checkstring (L, 1), sizeof (capname));
+    res = tigetflag (capname);
     if (-1 == res)
-        return luaL_error (L, "`%s' is not a boolean capability", ti_capname);
+        return luaL_error (L, "`%s' is not a boolean capability", capname);
     else
         lua_pushboolean (L, res);
     return 1;
@@ -1853,12 +6061,13 @@ static int ti_getflag (lua_State *L)
 
 static int ti_getnum (lua_State *L)
 {
+    char capname[32];
     int res;
 
-    strlcpy (ti_capname, luaL_checkstring (L, 1), sizeof (ti_capname));
-    res = tigetnum (ti_capname);
+    strlcpy (capname, luaL_checkstring (L, 1), sizeof (capname));
+    res = tigetnum (capname);
     if (-2 == res)
-        return luaL_error (L, "`%s' is not a numeric capability", ti_capname);
+        return luaL_error (L, "`%s' is not a numeric capability", capname);
     else if (-1 == res)
         lua_pushnil (L);
     else
@@ -1868,12 +6077,13 @@ static int ti_getnum (lua_State *L)
 
 static int ti_getstr (lua_State *L)
 {
+    char capname[32];
     const char *res;
 
-    strlcpy (ti_capname, luaL_checkstring (L, 1), sizeof (ti_capname));
-    res = tigetstr (ti_capname);
+    strlcpy (capname, luaL_checkstring (L, 1), sizeof (capname));
+    res = tigetstr (capname);
     if ((char *) -1 == res)
-        return luaL_error (L, "`%s' is not a string capability", ti_capname);
+        return luaL_error (L, "`%s' is not a string capability", capname);
     else if (NULL == res)
         lua_pushnil (L);
     else
@@ -1887,14 +6097,54 @@ static int ti_getstr (lua_State *L)
 ** register functions
 ** =======================================================
 */
+/* grid members */
+static const luaL_reg gridlib[] =
+{
+    { "size",       grid_size       },
+    { "get",        grid_get        },
+    { "row",        grid_row        },
+    { "fill",       grid_fill       },
+    { "copy",       grid_copy       },
+    { "scroll",     grid_scroll     },
+
+    { NULL, NULL }
+};
+
 /* chstr members */
+static const luaL_reg screenlib[] =
+{
+    { "stdscr",     lcs_stdscr      },
+    { "set_term",   lc_set_term     },
+    { "close",      lc_delscreen    },
+    { "__tostring", lcs_tostring    },
+
+    { NULL, NULL }
+};
+
+#ifdef HAVE_NCURSESW
+static const luaL_reg wchstrlib[] =
+{
+    { "len",        wchstr_len      },
+    { "set_str",    wchstr_set_str  },
+    { "set_ch",     wchstr_set_ch   },
+    { "get",        wchstr_get      },
+    { "text",       wchstr_text     },
+
+    { NULL, NULL }
+};
+#endif
+
 static const luaL_reg chstrlib[] =
 {
     { "len",        chstr_len       },
     { "set_ch",     chstr_set_ch    },
     { "set_str",    chstr_set_str   },
+    { "set_str_attrs", chstr_set_str_attrs },
     { "get",        chstr_get       },
     { "dup",        chstr_dup       },
+    { "view",       chstr_view      },
+    { "text",       chstr_text      },
+    { "runs",       chstr_runs      },
 
     { NULL, NULL }
 };
@@ -1946,6 +6196,7 @@ static const luaL_reg windowlib[] =
     /* refresh */
     { "refresh", lcw_wrefresh },
     { "noutrefresh", lcw_wnoutrefresh },
+    { "mark", lcw_mark },
     { "redrawwin", lcw_redrawwin },
     { "redrawln", lcw_wredrawln },
 
@@ -1960,6 +6211,8 @@ static const luaL_reg windowlib[] =
     { "touchline", lcw_touchline },
     { "is_linetouched", lcw_is_linetouched },
     { "is_wintouched", lcw_is_wintouched },
+    { "touched_lines", lcw_touched_lines },
+    { "touched_span", lcw_touched_span },
 
     /* attrs */
     { "attroff", lcw_wattroff },
@@ -1971,6 +6224,11 @@ static const luaL_reg windowlib[] =
     /* getch */
     { "getch", lcw_wgetch },
     { "mvgetch", lcw_mvwgetch },
+    { "getch_batch", lcw_wgetch_batch },
+#ifdef HAVE_NCURSESW
+    { "get_wch", lcw_wget_wch },
+    { "get_wch_batch", lcw_wget_wch_batch },
+#endif
 
     /* getyx */
     EWF(getyx)
@@ -1994,10 +6252,18 @@ static const luaL_reg windowlib[] =
     /* addchstr */
     { "addchstr", lcw_waddchnstr },
     { "mvaddchstr", lcw_mvwaddchnstr },
+#ifdef HAVE_NCURSESW
+    { "add_wchstr", lcw_wadd_wchnstr },
+    { "mvadd_wchstr", lcw_mvwadd_wchnstr },
+#endif
 
     /* addstr */
     { "addstr", lcw_waddnstr },
     { "mvaddstr", lcw_mvwaddnstr },
+#ifdef HAVE_NCURSESW
+    { "addwstr", lcw_waddnwstr },
+    { "mvaddwstr", lcw_mvwaddnwstr },
+#endif
 
     /* bkgd */
     EWF(wbkgdset)
@@ -2008,6 +6274,7 @@ static const luaL_reg windowlib[] =
     { "overlay", lcw_overlay },
     { "overwrite", lcw_overwrite },
     { "copywin", lcw_copywin },
+    { "blit", lcw_blit },
 
     /* delch */
     { "delch", lcw_wdelch },
@@ -2021,12 +6288,18 @@ static const luaL_reg windowlib[] =
     /* getstr */
     { "getstr", lcw_wgetnstr },
     { "mvgetstr", lcw_mvwgetnstr },
+#ifdef HAVE_NCURSESW
+    { "get_wstr", lcw_wgetn_wstr },
+#endif
 
     /* inch */
     EWF(winch)
     EWF(mvwinch)
     EWF(winchnstr)
     EWF(mvwinchnstr)
+    { "inchstr_into", lcw_winchnstr_into },
+    { "mvinchstr_into", lcw_mvwinchnstr_into },
+    { "inchstr_all", lcw_winchstr_all },
 
     /* instr */
     EWF(winnstr)
@@ -2041,6 +6314,10 @@ static const luaL_reg windowlib[] =
     EWF(winsnstr)
     EWF(mvwinsstr)
     EWF(mvwinsnstr)
+#ifdef HAVE_NCURSESW
+    { "ins_wstr", lcw_wins_nwstr },
+    { "mvins_wstr", lcw_mvwins_nwstr },
+#endif
 
     /* misc */
     {"__gc",        lcw_delwin  }, /* rough safety net */
@@ -2051,13 +6328,54 @@ static const luaL_reg windowlib[] =
 #define ECF(name) { #name, lc_ ## name },
 static const luaL_reg curseslib[] =
 {
+    /* headless */
+    { "headless",       lc_headless     },
+    { "headless_output", lc_headless_output },
+    { "headless_input", lc_headless_input },
+
+    /* screens */
+    { "newterm",        lc_newterm      },
+    { "set_term",       lc_set_term     },
+    { "delscreen",      lc_delscreen    },
+    { "screen",         lc_screen_current },
+
+    /* event loop */
+    { "input_fd",       lc_input_fd     },
+    { "wait",           lc_wait         },
+
+    /* frames */
+    { "frame",          lc_frame        },
+    { "max_fps",        lc_max_fps      },
+
+    /* render thread */
+    { "render_thread",  lc_render_thread },
+    { "submit_frame",   lc_submit_frame },
+
+    /* output statistics */
+    { "stats",          lc_stats        },
+    { "reset_stats",    lc_reset_stats  },
+    { "latency_stats",  lc_latency_stats },
+
+    /* profiling */
+    { "profile",        lc_profile      },
+    { "profile_reset",  lc_profile_reset },
+
+    /* tracing */
+    { "trace_dump",     lc_trace_dump   },
+
     /* chstr helper function */
     { "new_chstr",      lc_new_chstr    },
+#ifdef HAVE_NCURSESW
+    { "new_wchstr",     lc_new_wchstr   },
+#endif
+    { "new_grid",       lc_new_grid     },
 
     /* initscr */
+    { "initscr",        lc_initscr      },
     { "endwin",         lc_endwin       },
     { "isendwin",       lc_isendwin     },
     { "stdscr",         lc_stdscr       },
+    { "curscr",         lc_curscr       },
     { "cols",           lc_COLS         },
     { "lines",          lc_LINES        },
 
@@ -2121,6 +6439,22 @@ static const luaL_reg curseslib[] =
     { "tigetnum",	ti_getnum	},
     { "tigetstr",	ti_getstr	},
 
+    /* stdscr shortcuts */
+    ECF(addch)
+    ECF(addstr)
+    ECF(attrset)
+    ECF(clear)
+    ECF(clrtobot)
+    ECF(clrtoeol)
+    ECF(getch)
+    ECF(getstr)
+    { "getnstr",        lc_getstr       },
+    ECF(getyx)
+    ECF(keypad)
+    ECF(move)
+    ECF(refresh)
+    ECF(timeout)
+
     /* slk */
     ECF(slk_init)
     ECF(slk_set)
@@ -2139,42 +6473,157 @@ static const luaL_reg curseslib[] =
 };
 
 
+/*
+** =======================================================
+** loading
+** =======================================================
+*/
+
+#ifdef HAVE_PTHREAD
+/* set up the lock, once for all states */
+static void lc_curses_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    /* a window's __gc may run while its own thread holds the lock */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&curses_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_cond_init(&render_cond, NULL);
+    locking = getenv("LCURSES_THREADS") != NULL;
+}
+#endif
+
+static int lc_state_gc(lua_State *L)
+{
+    lc_state *st = (lc_state *)lua_touserdata(L, 1);
+
+#ifdef HAVE_PTHREAD
+    if (render_running && render_owner == st)
+        lc_render_stop();
+    else if (render_running)
+    {
+        /* the thread must not count a frame of ours once we are gone */
+        pthread_mutex_lock(&curses_lock);
+        if (render_for == st)
+            render_for = NULL;
+        pthread_mutex_unlock(&curses_lock);
+    }
+#endif
+    /* windows collected later may still call wrapped functions */
+    st->tracing = 0;
+    free(st->trace_ring);
+    st->trace_ring = NULL;
+    if (st->io_fd >= 0)
+        close(st->io_fd);
+    st->io_fd = -2;
+    return 0;
+}
+
+/* return the state's lc_state, making it the first time */
+static lc_state *lc_newstate(lua_State *L)
+{
+    lc_state *st = lc_getstate(L);
+    const char *trace = getenv("LCURSES_TRACE");
+
+    if (st != NULL)
+        return st;
+
+    st = (lc_state *)lua_newuserdata(L, sizeof(lc_state));
+    memset(st, 0, sizeof(lc_state));
+    st->headless_keys = -1;
+    st->last_stat_kind = -1;
+    st->io_fd = -2;
+    st->profiling = getenv("LCURSES_PROFILE") != NULL;
+    if (trace != NULL)
+    {
+        long n = atol(trace);
+        for (st->trace_size = 1; st->trace_size < (uint64_t)n; st->trace_size <<= 1)
+            ;
+        if (n <= 0)
+            st->trace_size = LC_TRACE_DEFAULT;
+        st->trace_ring = calloc(st->trace_size, sizeof(lc_trace_record));
+        st->tracing = st->trace_ring != NULL;
+    }
+
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, lc_state_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, (void *)&MODULE_STATE);
+    lua_insert(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    return st;
+}
+
+
 /* Prototype to keep compiler happy. */
 int luaopen_curses_c (lua_State *L);
 
 int luaopen_curses_c (lua_State *L)
 {
+#ifdef HAVE_PTHREAD
+    pthread_once(&curses_once, lc_curses_init);
+#endif
+
     /*
-    ** create new metatable for window objects
+    ** make the module state, and wrap every function to count, trace
+    ** or lock its calls, if asked to
     */
-    luaL_newmetatable(L, WINDOWMETA);
-    lua_pushliteral(L, "__index");
-    lua_pushvalue(L, -2);               /* push metatable */
-    lua_rawset(L, -3);                  /* metatable.__index = metatable */
-    luaL_openlib(L, NULL, windowlib, 0);
-
-    lua_pop(L, 1);                      /* remove metatable from stack */
+    lc_newstate(L);
+    if (lc_wrapping(L))
+    {
+        lua_pushlightuserdata(L, (void *)&PROFILE_TABLE);
+        lua_newtable(L);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
 
     /*
-    ** create new metatable for chstr objects
+    ** create new metatables for window, chstr, grid and screen objects
     */
-    luaL_newmetatable(L, CHSTRMETA);
-    lua_pushliteral(L, "__index");
-    lua_pushvalue(L, -2);               /* push metatable */
-    lua_rawset(L, -3);                  /* metatable.__index = metatable */
-    luaL_openlib(L, NULL, chstrlib, 0);
+    lc_newmetatable(L, &WINDOWMETA, windowlib);
+    lc_newmetatable(L, &CHSTRMETA, chstrlib);
+    lc_newmetatable(L, &GRIDMETA, gridlib);
+    lc_newmetatable(L, &SCREENMETA, screenlib);
+#ifdef HAVE_NCURSESW
+    lc_newmetatable(L, &WCHSTRMETA, wchstrlib);
+#endif
 
-    lua_pop(L, 1);                      /* remove metatable from stack */
+    /*
+    ** create the weak table mapping WINDOW pointers to objects, and
+    ** the set of windows that belong to curses
+    */
+    lua_pushlightuserdata(L, (void *)&WINDOW_CACHE);
+    lcw_newcache(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pushlightuserdata(L, (void *)&ROOT_WINDOWS);
+    lua_newtable(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
 
     /*
     ** create global table with curses methods/variables/constants
     */
     luaL_register(L, "curses", curseslib);
+    if (lc_wrapping(L))
+        lc_wrap_lib(L, "curses", '.', curseslib);
 
-    lua_pushstring(L, "initscr");
-    lua_pushvalue(L, -2);
-    lua_pushcclosure(L, lc_initscr, 1);
-    lua_settable(L, -3);
+    /*
+    ** resolve constants on first use, keeping any __index the table
+    ** already has as the fallback
+    */
+    if (!lua_getmetatable(L, -1))
+    {
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setmetatable(L, -3);
+    }
+    lua_pushliteral(L, "__index");
+    lua_pushliteral(L, "__index");
+    lua_rawget(L, -3);
+    lua_pushcclosure(L, lc_constant_index, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);                      /* remove metatable from stack */
 
     return 1;
 }
@@ -255,18 +255,14 @@ section of lcurses.c
 XXWINDOWLIBXX
 </p><p></p>
 </DIV><h2><a name="constants">CONSTANTS</a></h2><DIV CLASS="txt">
-<p>These constants only appear after curses.initscr() is called;
-they can be seen by:</p>
-<pre>
-  require 'curses' ; curses.initscr() ; local a = {};
-  for k in pairs(curses) do
-    if type(curses[k]) == 'number' then a[#a+1]=k end
-  end
-  curses.endwin()
-  table.sort(a) ; for i,k in ipairs(a) do print(k) end</pre>
-<p>and are defined in the
+<p>These constants are looked up when first used, and then kept in
+the curses table; the ACS_ values are only available after
+curses.initscr() is called.  Besides those listed below, KEY_F0 to
+KEY_F63 are available, and after curses.initscr() so are keys named
+by extended terminfo capabilities, such as KEY_kUP5.
+They are defined in the
 <A HREF="./lcurses_c.html#constants">
-static void register_curses_constants</A>
+static const lc_constant lc_constants</A>
 section of lcurses.c</p>
 <p>ACS_BLOCK
 ACS_BOARD
@@ -276,18 +272,25 @@ ACS_CKBOARD
 ACS_DARROW
 ACS_DEGREE
 ACS_DIAMOND
+ACS_GEQUAL
 ACS_HLINE
 ACS_LANTERN
 ACS_LARROW
+ACS_LEQUAL
 ACS_LLCORNER
 ACS_LRCORNER
 ACS_LTEE
+ACS_NEQUAL
+ACS_PI
 ACS_PLMINUS
 ACS_PLUS
 ACS_RARROW
 ACS_RTEE
 ACS_S1
+ACS_S3
+ACS_S7
 ACS_S9
+ACS_STERLING
 ACS_TTEE
 ACS_UARROW
 ACS_ULCORNER
@@ -298,13 +301,20 @@ A_ATTRIBUTES
 A_BLINK
 A_BOLD
 A_CHARTEXT
+A_COLOR
 A_DIM
+A_HORIZONTAL
 A_INVIS
+A_LEFT
+A_LOW
 A_NORMAL
 A_PROTECT
 A_REVERSE
+A_RIGHT
 A_STANDOUT
-A_UNDERLINE</p>
+A_TOP
+A_UNDERLINE
+A_VERTICAL</p>
 <p>COLOR_BLACK
 COLOR_BLUE
 COLOR_CYAN
@@ -326,6 +336,7 @@ KEY_CANCEL
 KEY_CATAB
 KEY_CLEAR
 KEY_CLOSE
+KEY_CODE_YES
 KEY_COMMAND
 KEY_COPY
 KEY_CREATE
@@ -339,19 +350,6 @@ KEY_ENTER
 KEY_EOL
 KEY_EOS
 KEY_EXIT
-KEY_F0
-KEY_F1
-KEY_F10
-KEY_F11
-KEY_F12
-KEY_F2
-KEY_F3
-KEY_F4
-KEY_F5
-KEY_F6
-KEY_F7
-KEY_F8
-KEY_F9
 KEY_FIND
 KEY_HELP
 KEY_HOME
@@ -360,7 +358,9 @@ KEY_IL
 KEY_LEFT
 KEY_LL
 KEY_MARK
+KEY_MAX
 KEY_MESSAGE
+KEY_MIN
 KEY_MOUSE
 KEY_MOVE
 KEY_NEXT
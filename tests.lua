@@ -1,2 +1,203 @@
 -- Trivial test that we can load the module
 require "curses"
+
+-- chstr buffers work without a terminal
+local cs = curses.new_chstr (5)
+cs:set_str (1, "ab", 0, 10)
+assert (cs:get (0) == string.byte " ")
+assert (cs:get (1) == string.byte "a" and cs:get (4) == string.byte "b")
+cs:set_ch (3, "x", 0, 10)
+assert (cs:get (3) == string.byte "x" and cs:get (4) == string.byte "x")
+assert (cs:get (5) == nil)
+
+cs:set_str_attrs (0, "abcde", "\1\2", { 256, 512 })
+assert (select (2, cs:get (0)) == 256 and select (2, cs:get (1)) == 512)
+assert (select (2, cs:get (2)) == 0)
+cs:set_str_attrs (0, "abcde", { { 3, 1024 } })
+assert (select (2, cs:get (2)) == 1024 and select (2, cs:get (3)) == 0)
+
+local v = cs:view (2, 2)
+assert (v:len () == 2)
+v:set_str (0, "xyz")
+assert (cs:get (2) == string.byte "x" and cs:get (3) == string.byte "y")
+assert (cs:get (4) == string.byte "e")
+assert (v:view (1):get (0) == string.byte "y")
+assert (v:dup ():get (1) == string.byte "y")
+
+assert (cs:text () == "abxye")
+local runs = cs:runs ()
+assert (#runs == 2 and runs[1][1] == "ab" and runs[1][2] == 1024)
+assert (runs[2][1] == "xye" and runs[2][2] == 0 and runs[2][3] == 0)
+
+-- wide character buffers
+if curses.new_wchstr then
+  local ws = curses.new_wchstr (6)
+  ws:set_str (0, "a\195\169\226\130\172", curses.A_BOLD)
+  ws:set_ch (3, "-", curses.A_NORMAL, 3)
+  assert (ws:text () == "a\195\169\226\130\172---")
+  local text, attr = ws:get (2)
+  assert (text == "\226\130\172" and attr == curses.A_BOLD)
+  ws:set_str (0, "xy", curses.A_NORMAL, 10)
+  assert (ws:text () == "xyxyxy")
+end
+
+-- grids
+local g = curses.new_grid (3, 4)
+g:fill (0, 0, 3, 4, ".")
+g:fill (-1, 2, 2, 5, "#")
+assert (g:row (0):text () == "..##" and g:row (1):text () == "....")
+g:row (2):set_str (0, "abcd")
+g:copy (g, 2, 0, 1, 1, 1, 4)
+assert (g:row (1):text () == ".abc")
+g:scroll (1)
+assert (g:row (0):text () == ".abc" and g:row (2):text () == "    ")
+assert (g:get (0, 1) == string.byte "a")
+
+-- constants are available before initscr
+assert (curses.A_BOLD ~= nil and curses.COLOR_RED ~= nil)
+assert (curses.KEY_F63 == curses.KEY_F0 + 63 and curses.KEY_F64 == nil)
+assert (curses.print == print)
+
+-- drawing on a headless terminal
+local scr = curses.headless (5, 20)
+assert (scr == curses.stdscr ())
+assert (select (2, scr:getmaxyx ()) == 20)
+scr:mvaddstr (1, 2, "hello")
+scr:refresh ()
+assert (curses.headless_output ():find ("hello", 1, true))
+assert (curses.headless_output () == "")
+assert (curses.curscr ():mvwinnstr (1, 2, 5) == "hello")
+local tw = curses.newwin (4, 10, 0, 0)
+tw:noutrefresh ()
+tw:mvaddstr (1, 2, "ab")
+tw:mvaddstr (2, 0, "c")
+local touched = tw:touched_lines ()
+assert (#touched == 2 and touched[1] == 1 and touched[2] == 2)
+touched = tw:touched_lines (true)
+assert (#touched == 1 and touched[1][1] == 1 and touched[1][2] == 2)
+local first, last = tw:touched_span (1)
+assert (first <= 2 and last >= 3 and tw:touched_span (0) == nil)
+tw:close ()
+local mw = curses.newwin (2, 5, 3, 0)
+mw:mvaddstr (0, 0, "frame")
+mw:mark ()
+mw:mark ()
+assert (curses.frame () == true)
+assert (curses.headless_output ():find ("frame", 1, true))
+assert (curses.frame () == false)
+local stats = curses.stats ()
+assert (stats.doupdate.calls >= 1 and stats.last.call == "doupdate")
+assert (stats.total.calls == stats.doupdate.calls + stats.wrefresh.calls + stats.prefresh.calls)
+assert (stats.total.bytes == nil or stats.total.bytes > 0)
+curses.reset_stats ()
+assert (curses.stats ().total.calls == 0 and curses.stats ().last == nil)
+local profile = curses.profile ()
+if os.getenv ("LCURSES_PROFILE") then
+  assert (profile["window:mvaddstr"].calls == 4 and profile["curses.frame"].calls == 2)
+  curses.profile_reset ()
+  assert (next (curses.profile ()) == nil)
+else
+  assert (profile == nil)
+end
+mw:move (1, 2)
+if os.getenv ("LCURSES_TRACE") then
+  assert (curses.trace_dump ("lcurses.trace"))
+  local count, calls = require "trace_decode".decode ("lcurses.trace")
+  os.remove ("lcurses.trace")
+  local move, dump = calls[#calls - 1], calls[#calls]
+  assert (count >= #calls and dump.name == "curses.trace_dump")
+  assert (move.name == "window:move" and move.window ~= 0 and move.nargs == 2)
+  assert (move.args[1] == 1 and move.args[2] == 2 and move.args[3] == 0)
+else
+  assert (curses.trace_dump ("lcurses.trace") == nil)
+end
+assert (curses.render_thread () == false)
+if pcall (curses.render_thread, true) then
+  mw:mvaddstr (1, 0, "async")
+  mw:mark ()
+  assert (curses.submit_frame () == true)
+  -- the frame goes out while getch waits for a key
+  scr:timeout (200)
+  assert (scr:getch () == nil)
+  local _, frames = curses.render_thread ()
+  assert (frames == 1)
+  assert (curses.render_thread (false))
+  assert (curses.headless_output ():find ("async", 1, true))
+end
+mw:close ()
+curses.headless_input ("q")
+scr:timeout (100)
+assert (scr:getch () == string.byte "q")
+curses.doupdate ()
+if curses.stats ().doupdate.bytes then
+  -- nothing was written, so the key is still waiting
+  assert (curses.latency_stats ().count == 0)
+end
+scr:mvaddstr (0, 0, "latency")
+scr:noutrefresh ()
+curses.doupdate ()
+local latency = curses.latency_stats ()
+assert (latency.count == 1 and latency.p50 <= latency.p99 and latency.p99 <= latency.max)
+curses.headless_input ("x")
+local input, resized, ready = curses.wait ({ curses.input_fd () }, 0)
+assert (input and not resized and ready[1] == curses.input_fd ())
+assert (scr:getch () == string.byte "x")
+assert (not curses.wait (nil, 0))
+curses.headless_input ("abc")
+local keys = scr:getch_batch ()
+assert (#keys == 3 and keys[1] == string.byte "a" and keys[3] == string.byte "c")
+curses.headless_input ("de\27OA")
+scr:keypad (true)
+local str, key = scr:getch_batch (10, true)
+assert (str == "de" and key == curses.KEY_UP)
+-- a function key first comes back as an empty string and the key, and
+-- nothing is left queued for wait to miss
+curses.headless_input ("\27OA")
+str, key = scr:getch_batch (10, true)
+assert (str == "" and key == curses.KEY_UP)
+assert (not curses.wait (nil, 0) and scr:getch_batch (10, true) == nil)
+if scr.get_wch and os.setlocale ("C.UTF-8", "ctype") then
+  curses.headless_input ("h\195\169\226\130\172\27OA")
+  local chars = scr:get_wch_batch ()
+  assert (chars[1] == "h" and chars[2] == "\195\169" and chars[3] == "\226\130\172")
+  assert (chars[4] == curses.KEY_UP)
+  curses.headless_input ("\226\130\172\27OA")
+  str, key = scr:get_wch_batch (10, true)
+  assert (str == "\226\130\172" and key == curses.KEY_UP)
+  scr:mvaddwstr (2, 0, "h\195\169llo")
+  scr:refresh ()
+  assert (curses.headless_output ():find ("h\195\169llo", 1, true))
+end
+curses.endwin ()
+
+-- more than one terminal at a time
+local out, inp = io.open ("/dev/null", "w"), io.open ("/dev/null")
+local a, home = curses.newterm ("xterm", out, inp)
+assert (home:stdscr () == scr)
+local awin = curses.newwin (2, 2, 0, 0)
+local b = curses.newterm ("xterm", out, inp)
+assert (curses.screen () == b and curses.stdscr () == b:stdscr ())
+assert (curses.set_term (a) == b and curses.stdscr () == a:stdscr ())
+a:close ()
+assert (tostring (awin) == "curses window (closed)")
+assert (curses.screen () == nil and curses.stdscr () == nil)
+assert (curses.set_term (b) == nil)
+curses.delscreen (b)
+assert (curses.set_term (home) == nil and curses.stdscr () == scr)
+-- ripoffline callbacks are counted afresh for each screen started
+local ripped = 0
+for _ = 1, 2 do
+  curses.ripoffline (true, function (w, cols) ripped = ripped + 1 end)
+  curses.newterm ("xterm", out, inp):close ()
+  curses.set_term (home)
+end
+assert (ripped == 2)
+-- a screen let go of stays live until it is deleted
+curses.newterm ("xterm", out, inp)
+collectgarbage ()
+collectgarbage ()
+local c = curses.set_term (home)
+assert (tostring (c) ~= "curses screen (deleted)" and c:stdscr ())
+c:close ()
+out:close ()
+inp:close ()
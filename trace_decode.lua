@@ -0,0 +1,78 @@
+-- Decode a call trace written by curses.trace_dump
+--
+-- As a script, print one line per call:
+--
+--   lua trace_decode.lua FILE
+--
+-- As a module, decode returns the number of calls traced and a list of
+-- the calls kept, oldest first, each a table of time (seconds from the
+-- first call kept), name, window (a number, 0 if none), nargs and args.
+-- For window methods, window is self, and nargs and args count only the
+-- arguments after it.
+
+local function u32 (s, i)
+  local a, b, c, d = s:byte (i, i + 3)
+  return a + b * 0x100 + c * 0x10000 + d * 0x1000000
+end
+
+local function i32 (s, i)
+  local v = u32 (s, i)
+  return v >= 0x80000000 and v - 0x100000000 or v
+end
+
+local function u64 (s, i)
+  return u32 (s, i) + u32 (s, i + 4) * 0x100000000
+end
+
+local function decode (path)
+  local h = assert (io.open (path, "rb"))
+  local s = h:read ("*a")
+  h:close ()
+  assert (s:sub (1, 8) == "LCTRACE1", "not a curses trace: " .. path)
+
+  local names, pos = {}, 13
+  for _ = 1, u32 (s, 9) do
+    local id, len = u32 (s, pos), u32 (s, pos + 4)
+    names[id] = s:sub (pos + 8, pos + 7 + len)
+    pos = pos + 8 + len
+  end
+
+  local count, n = u64 (s, pos), u32 (s, pos + 8)
+  local calls, start = {}, nil
+  pos = pos + 12
+  for i = 1, n do
+    local t = u64 (s, pos)
+    start = start or t
+    local id, nargs = u32 (s, pos + 16), u32 (s, pos + 20)
+    calls[i] = {
+      time = (t - start) / 1e9,
+      name = names[id] or ("#" .. id),
+      window = u64 (s, pos + 8),
+      nargs = nargs,
+      args = { i32 (s, pos + 24), i32 (s, pos + 28),
+               i32 (s, pos + 32), i32 (s, pos + 36) },
+    }
+    pos = pos + 40
+  end
+  return count, calls
+end
+
+if arg and arg[0] and arg[0]:match ("trace_decode%.lua$") then
+  if not arg[1] then
+    io.stderr:write ("Usage: lua trace_decode.lua FILE\n")
+    os.exit (1)
+  end
+  local count, calls = decode (arg[1])
+  print (string.format ("%d calls traced, last %d kept", count, #calls))
+  for _, c in ipairs (calls) do
+    local args = {}
+    for i = 1, math.min (c.nargs, #c.args) do
+      args[i] = tostring (c.args[i])
+    end
+    print (string.format ("%12.6f %-24s %-14s %s", c.time, c.name,
+                          c.window ~= 0 and string.format ("%x", c.window) or "-",
+                          table.concat (args, " ")))
+  end
+end
+
+return { decode = decode }